@@ -1,213 +1,5224 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* memfd_create, fallocate */
+#endif
 #include<stdlib.h>
 #include<assert.h>
+#include<fcntl.h>
+#include<limits.h>
+#include<math.h>
+#include<stdarg.h>
+#include<stdatomic.h>
+#include<stddef.h>
+#include<stdint.h>
 #include<sys/types.h>
 #include<sys/wait.h>
+#include<sys/time.h>
+#include<sys/resource.h>
+#include<sys/stat.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#ifdef __linux__
+#include<linux/perf_event.h>
+#include<sys/ioctl.h>
+#include<sys/epoll.h>
+#include<sys/mman.h>
+#include<sys/sendfile.h>
+#include<sys/syscall.h>
+#endif
+#include<poll.h>
+#include<pthread.h>
+#include<sched.h>
+#include<signal.h>
+#include<spawn.h>
+#include<time.h>
 #include<unistd.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include<emmintrin.h>
+#endif
+/* --heap counts what the allocator hooks of mtsuite_heap.c report; see
+ * mtsuite_heap_note. */
+#if defined(__GLIBC__)
+#define MTSUITE_HEAP_HOOKS
+#endif
 // NO_FORKING not considered
 #include "mtsuite.h"
 
 #define MTSUITE_MAX_NAMELEN     16384
+/* Seconds a timed-out child gets to exit after SIGTERM before SIGKILL. */
+#define MTSUITE_KILL_GRACE      1.0
+/* Most bytes of failure messages kept for one test. */
+#define MTSUITE_MAX_MESSAGES    65536
+/* Most measurement rounds a benchmark can keep samples for. */
+#define MTSUITE_MAX_BENCH_ROUNDS 128
+/* Fewest measurement rounds a benchmark gets when a baseline is in use. */
+#define MTSUITE_MIN_BASELINE_ROUNDS 20
+/* Entries in counter_descs. */
+#define MTSUITE_N_COUNTERS      9
+/* Deepest nesting of mtsuite_trace_begin() spans. */
+#define MTSUITE_TRACE_DEPTH     16
+/* Shortest --status-interval, in seconds; shorter ones are raised to it. */
+#define MTSUITE_MIN_STATUS_INTERVAL 0.01
+/* Longest name kept for an open mtsuite_trace_begin() span, with its NUL. */
+#define MTSUITE_TRACE_NAMELEN   128
 
 typedef struct Testcase_t Testcase_t;
 typedef struct Testgroup_t Testgroup_t;
 typedef struct TestlistAlias_t TestlistAlias_t;
 typedef struct TestcaseSetup_t TestcaseSetup_t;
+typedef struct Testrunner_t Testrunner_t;
 
-static int in_mtsuite_main = 0;
-static int n_ok = 0;
-static int n_bad = 0;
-static int n_skipped = 0;
-
-static int opt_verbosity = 1;  /* quiet=<0, terse=1, normal=1, verbose=2 */
-static const char *verbosity_flag = "";
+enum Isolation { ISOLATE_FORK, ISOLATE_POOL, ISOLATE_SPAWN };
 
+/* What new runners start with; see mtsuite_set_aliases(). */
 static const TestlistAlias_t *cfg_aliases = NULL;
 
-enum Outcome {SKIP=2, OK=1, FAIL=0 };
-static enum Outcome cur_test_outcome = 0;
-
-static const char *cur_test_prefix = NULL;
-static const char *cur_test_name = NULL;
+enum Outcome {
+    TIMEOUT=MTSUITE_TIMED_OUT, SKIP=MTSUITE_SKIPPED, OK=MTSUITE_OK,
+    FAIL=MTSUITE_FAILED
+};
 
 static void usage(Testgroup_t *groups, int list_groups);
 static int process_test_option(Testgroup_t *groups, const char *test);
 
-static enum Outcome _testcase_run_bare(const Testcase_t *tcase){
-    void *env = NULL;
-    int outcome;
-    if(tcase->config){
-        env = tcase->config->setup(tcase);
-        if(!env){
-            return FAIL;
-        }else if(env == (void*)MTSUITE_SKIP){
-            return SKIP;
+/* Whether `group` has a case at `j`: a group of registered tests knows its
+ * size, one written by hand ends at a NULL name. */
+static int _has_case(const Testgroup_t *group, int j){
+    if(group->n_cases){ return (size_t)j < group->n_cases; }
+    return group->cases[j].name != NULL;
+}
+
+static double _monotonic_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* poll() timeout for a wait of `seconds`, rounded up so we never wake just
+ * short of it; a wait too long for an int is cut down to INT_MAX ms. */
+static int _poll_timeout(double seconds){
+    if(seconds <= 0){ return 0; }
+    if(!(seconds < (INT_MAX - 1) / 1000.0)){ return INT_MAX; }
+    return (int)(seconds * 1000) + 1;
+}
+
+/* A benchmark's samples from a --compare-baseline file. */
+struct BaselineEntry {
+    char *name;
+    int n_samples;
+    double *samples;
+};
+
+/* Samples and statistics for one benchmark, all in nanoseconds per op. */
+struct BenchStats {
+    unsigned long iters;    /* iterations per round */
+    int n_samples;
+    double samples[MTSUITE_MAX_BENCH_ROUNDS];
+    double mean, median, min, mad;
+    double cv;              /* coefficient of variation, percent */
+    int migrations;         /* times the CPU changed between rounds */
+    long nivcsw;            /* involuntary context switches while measured */
+    int attempts;           /* measurements made, the kept one last */
+    int noisy;              /* no attempt met the limits */
+};
+
+/* Everything we learn about one run of one test. */
+/* A test's captured stdout or stderr: `len` bytes at `off` in file `fd`,
+ * closed with the result if `owned`; or `len` bytes at `text`. */
+struct Capture {
+    int fd;
+    int owned;
+    const char *text;
+    off_t off;
+    size_t len;
+};
+
+/* What a test did with the heap, from setup through cleanup (--heap). */
+struct HeapStats {
+    long allocs;            /* calls that returned memory */
+    long bytes;             /* bytes those calls asked for */
+    long peak;              /* most bytes held at once */
+    long leaked;            /* bytes still held after cleanup */
+};
+
+/* Performance counters read around a test's callback (--counters), or
+ * around a benchmark's measured rounds. */
+enum CounterMode { COUNTERS_NONE, COUNTERS_HARDWARE, COUNTERS_SOFTWARE };
+
+struct CounterStats {
+    int mode;               /* enum CounterMode */
+    unsigned present;       /* bit i: counter_descs[i] was counted */
+    double ops;             /* benchmark iterations counted over, or 0 */
+    double value[MTSUITE_N_COUNTERS];   /* scaled up if multiplexed */
+};
+
+struct TestResult {
+    const Testgroup_t *group;
+    const Testcase_t *tcase;
+    enum Outcome outcome;
+    double t_wall;          /* seconds, as seen by the runner */
+    double t_setup;         /* seconds spent in config->setup */
+    double t_callback;      /* seconds spent in the callback */
+    double t_cleanup;       /* seconds spent in config->cleanup */
+    double utime, stime;    /* CPU seconds */
+    long maxrss;            /* KiB */
+    long nvcsw, nivcsw;     /* voluntary/involuntary context switches */
+    struct BenchStats bench; /* only for benchmark cases */
+    struct HeapStats heap;  /* only with --heap */
+    struct CounterStats counters; /* only with --counters */
+    double t_begin;         /* monotonic, when t_wall started */
+    int track;              /* trace track of the worker that ran it */
+    const char *messages;   /* failure messages, see _next_message */
+    size_t messages_len;
+    const char *trace;      /* a child's trace records, see _trace_add */
+    size_t trace_len;
+    struct Capture out, err; /* see _capture_show */
+};
+
+/* A block the test still holds, and the size it asked for (--heap). */
+struct HeapBlock {
+    const void *p;
+    size_t size;
+};
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    max_align_t data[];
+};
+
+/* What the running test has reported about itself.  Each --threads worker
+ * and each async test in flight has its own; every other thread, including
+ * helper threads started by a test, uses its runner's main_state, so a test
+ * that runs alone still sees its helpers' failures. */
+struct TestState {
+    const Testgroup_t *group;
+    const char *prefix;
+    const char *name;       /* cleared once printed by a quiet failure */
+    _Atomic int outcome;
+    /* Failure messages, as "file\0line\0text\0" records; reused from test
+     * to test. */
+    char *msg_buf;
+    size_t msg_len, msg_cap;
+    pthread_mutex_t lock;   /* name and messages */
+    /* In a --threads worker, what the test printed through mtsuite. */
+    char *out;
+    size_t out_len, out_cap;
+    /* With --heap, what the test has allocated; only counted while armed,
+     * under heap_lock.  Every block it holds is in heap_blocks, an open
+     * addressing table on the pointer, with the size it asked for, so that
+     * held bytes are the bytes asked for and freeing a block from before
+     * the test counts for nothing. */
+    _Atomic int heap_armed;
+    atomic_flag heap_lock;
+    long heap_allocs, heap_bytes, heap_held, heap_peak;
+    struct HeapBlock *heap_blocks;
+    size_t heap_n, heap_cap;
+    /* With --counters, the counter group of the thread running the test,
+     * leader first; perf_which maps group order to counter_descs. */
+    pid_t perf_pid;         /* process that opened it; 0 = not yet */
+    int perf_mode;          /* enum CounterMode */
+    int perf_n;
+    int perf_fds[MTSUITE_N_COUNTERS];
+    int perf_which[MTSUITE_N_COUNTERS];
+    /* With --trace, spans seen on this thread, and the open ones of
+     * mtsuite_trace_begin(). */
+    char *trace;
+    size_t trace_len, trace_cap;
+    int trace_track;
+    int trace_depth;
+    double trace_begun[MTSUITE_TRACE_DEPTH];
+    char trace_names[MTSUITE_TRACE_DEPTH][MTSUITE_TRACE_NAMELEN];
+    /* The test's scratch arena: chunks are kept from test to test, and
+     * arena_cur/arena_used say how much of them the current test has. */
+    struct ArenaChunk *arena_head, *arena_cur;
+    size_t arena_used;
+    struct AsyncTest *async;    /* while an async test is in flight */
+};
+
+/* Everything one run keeps: its options, its copy of the tests, its counts
+ * and the state of each part of the runner.  Runners share nothing, so
+ * several can run at once; code working for one reaches it through
+ * _runner(). */
+struct Testrunner_t {
+    Testgroup_t *groups;        /* our copy; selection marks these */
+    Testcase_t *cases;          /* all of their cases, in one block */
+    const TestlistAlias_t *aliases;
+    int owns_process;   /* run by mtsuite_main: may redirect stdout */
+    int in_mtsuite_main;
+    int n_selected;     /* tests named so far; 0 = run them all */
+    int finished;       /* nothing (more) to run, e.g. after --help */
+    int result;         /* what mtsuite_runner_run() returns once finished */
+    int broken;         /* the runner itself failed: start no more tests */
+    /* Option values are the runner's own copies; see _option_copy. */
+    char *report_fname;         /* --output */
+    char *run_single;           /* --run-single */
+    int result_fd;              /* --result-fd; -1 = report by exit status */
+    int n_ok;
+    int n_bad;
+    int n_skipped;
+    int n_timeout;
+    /* Per-test outcomes for mtsuite_runner_results(). */
+    struct TestrunResult_t *results;
+    int n_results, cap_results;
+
+    int opt_verbosity;  /* quiet=<0, terse=1, normal=1, verbose=2 */
+    const char *verbosity_flag;
+    int opt_jobs;       /* 0 = run in-process, one test at a time */
+    int opt_threads;    /* 0 = no in-process thread pool */
+    unsigned long opt_memory;   /* bytes of .max_memory side by side;
+                                 * 0 = physical memory */
+    int opt_capture;    /* hide output of tests that pass */
+    enum Isolation opt_isolation;
+    double opt_timeout; /* seconds; 0 = no deadline */
+    int opt_slowest;    /* how many of the slowest tests to list */
+    int opt_show_times;
+    double opt_bench_time;  /* target seconds per benchmark round */
+    int opt_bench_rounds;
+    int opt_bench_warmup;
+    char *opt_bench_cpus;       /* --bench-cpus, as given */
+    int opt_bench_priority;     /* raise benchmarks' priority */
+    double opt_bench_max_cv;    /* percent; noisier is retried */
+    int opt_bench_retries;
+    double opt_baseline_alpha;  /* significance level */
+    double opt_baseline_min_change; /* percent */
+    int opt_shard, opt_shards;  /* --shard=I/N, 1-based */
+    int opt_failed_first;
+    int opt_rerun_failed;
+    int opt_heap;       /* account each test's heap use */
+    int opt_counters;   /* read performance counters per test */
+    int opt_trace;      /* record spans for --trace */
+    char *trace_fname;          /* NULL in a spawned child */
+    int opt_arena_size;     /* KiB in a test arena's first chunk */
+    int opt_arena_chunk;    /* KiB it grows by, at least */
+    int opt_async;      /* async tests in flight at once */
+    char *status_fname;             /* --status-file */
+    char *status_sockname;          /* --status-socket */
+    double opt_status_interval;     /* seconds between updates */
+
+    /* Every thread of the run not running a test of its own reports
+     * through this one; see struct TestState. */
+    struct TestState main_state;
+    int counters_errno; /* why the hardware set did not open */
+    double trace_t0;    /* when the run started */
+    struct TestResult *slowest; /* opt_slowest entries */
+    int n_slowest;
+    char *baseline_fname;           /* --save-baseline */
+    FILE *baseline_out;             /* opened when the run starts */
+    struct BaselineEntry *baseline; /* --compare-baseline */
+    int n_baseline;
+    int n_regressed;
+#ifdef __linux__
+    cpu_set_t bench_cpus;
+#endif
+    struct GroupFixture *fixtures;
+    const Testgroup_t *fixture_groups;
+    int n_fixtures;
+    pthread_mutex_t fixture_lock;
+    /* In a pool worker, its own command and result pipes; children forked
+     * for single tests close them. */
+    int worker_fds[2];
+    int capture_fds[2]; /* in-process tests' */
+    int saved_fds[2];   /* ours, while redirected */
+    const char *self_exe;   /* what to spawn */
+    char *self_argv0;
+    struct DurationEntry *durations;
+    int n_durations;
+    char *durations_fname;  /* --save-durations */
+    FILE *durations_out;
+    const struct Reporter *reporter;
+    FILE *report_out;
+    char *report_buf;
+    int n_reported;
+    int report_rewind;  /* report is a file of its own we may seek in */
+    char *cache_fname;  /* NULL or empty: no cache */
+    struct CacheEntry *cache;
+    int n_cache;
+    int cache_fd;       /* appended to, a record per write() */
+    pthread_mutex_t status_lock;
+    struct StatusSlot *status_slots;
+    int n_status_slots;
+    int status_total, status_done, status_ok;
+    int status_failed, status_timed_out, status_skipped;
+    double status_began, status_work, status_work_done;
+    double status_fallback; /* expected seconds, if none known */
+    pthread_t status_thread;
+    int status_sock;
+    int status_wake[2]; /* written to stop the thread */
+    char *status_buf;
+    size_t status_len, status_cap;
+    struct IndexEntry *index_tab;
+    int n_index;
+    char *index_names;
+    const Testgroup_t *index_groups;
+    pthread_mutex_t count_lock;
+};
+
+static _Thread_local Testrunner_t *cur_runner = NULL;
+static _Thread_local struct TestState *cur_state = NULL;
+
+/* Between declare_begin and declare_printf on this thread. */
+static _Thread_local int msg_recording = 0;
+static _Thread_local const char *msg_file = NULL;
+static _Thread_local int msg_line = 0;
+
+/* Where threads that belong to no runner report, such as a test's helper
+ * threads: to the run of mtsuite_main, which has the process to itself.
+ * In a program that embeds runners they cannot be told from the program's
+ * own threads, so they report to idle_runner, which nobody reads. */
+static Testrunner_t *_Atomic main_runner = NULL;
+static Testrunner_t idle_runner;
+static pthread_once_t idle_once = PTHREAD_ONCE_INIT;
+/* Runners in progress with --heap; the allocator hooks test only this. */
+_Atomic int mtsuite_heap_runners = 0;
+
+static void _runner_init(Testrunner_t *r);
+
+static void _idle_init(void){
+    _runner_init(&idle_runner);
+}
+
+static Testrunner_t *_runner(void){
+    Testrunner_t *r = cur_runner;
+    if(r || (r = main_runner)){ return r; }
+    pthread_once(&idle_once, _idle_init);
+    return &idle_runner;
+}
+
+static struct TestState *_state(void){
+    return cur_state ? cur_state : &_runner()->main_state;
+}
+
+#ifdef MTSUITE_HEAP_HOOKS
+/* Heap accounting.  A program that links mtsuite_heap.c in has the
+ * allocator's entry points interposed; each one hands the call to glibc's
+ * allocator and, while the calling thread's test is armed, counts it
+ * against that test here.  Unarmed, a call costs one extra branch.  The
+ * runner's own buffers use runner_realloc so that they never count.
+ * Programs that do not link it keep their allocator. */
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+#define runner_realloc __libc_realloc
+#define runner_free __libc_free
+
+static size_t _heap_home(const struct TestState *st, const void *p){
+    uint64_t h = (uint64_t)(uintptr_t)p * 0x9e3779b97f4a7c15ull;
+    return (size_t)(h >> 32) & (st->heap_cap - 1);
+}
+
+/* Add `p` to the test's blocks; -1 if there is no room for it. */
+static int _heap_remember(struct TestState *st, const void *p, size_t size){
+    size_t i;
+    if((st->heap_n + 1) * 2 > st->heap_cap){
+        struct HeapBlock *old = st->heap_blocks;
+        size_t old_cap = st->heap_cap, cap = old_cap ? old_cap * 2 : 256;
+        struct HeapBlock *blocks = __libc_calloc(cap, sizeof(*blocks));
+        if(!blocks){ return -1; }
+        st->heap_blocks = blocks;
+        st->heap_cap = cap;
+        for(i=0; i < old_cap; ++i){
+            size_t j;
+            if(!old[i].p){ continue; }
+            for(j=_heap_home(st, old[i].p); blocks[j].p; j=(j+1) & (cap-1))
+                ;
+            blocks[j] = old[i];
+        }
+        __libc_free(old);
+    }
+    for(i=_heap_home(st, p); st->heap_blocks[i].p;
+            i=(i+1) & (st->heap_cap-1))
+        ;
+    st->heap_blocks[i].p = p;
+    st->heap_blocks[i].size = size;
+    ++st->heap_n;
+    return 0;
+}
+
+/* Take `p` out of the test's blocks; returns the size it asked for, or 0
+ * if the test did not allocate it. */
+static size_t _heap_forget(struct TestState *st, const void *p){
+    size_t mask = st->heap_cap - 1, i, j, size;
+    if(!st->heap_cap){ return 0; }
+    for(i=_heap_home(st, p); st->heap_blocks[i].p != p; i=(i+1) & mask){
+        if(!st->heap_blocks[i].p){ return 0; }
+    }
+    size = st->heap_blocks[i].size;
+    /* Move back any later block of the run that this hole would hide. */
+    for(j=(i+1) & mask; st->heap_blocks[j].p; j=(j+1) & mask){
+        size_t k = _heap_home(st, st->heap_blocks[j].p);
+        if(((j - k) & mask) >= ((j - i) & mask)){
+            st->heap_blocks[i] = st->heap_blocks[j];
+            i = j;
+        }
+    }
+    st->heap_blocks[i].p = NULL;
+    --st->heap_n;
+    return size;
+}
+
+/* A call asked for `asked` bytes and got block `got` (NULL if none),
+ * and/or released block `gone`. */
+static void _heap_note(const void *got, size_t asked, const void *gone){
+    struct TestState *st = _state();
+    if(!st->heap_armed){ return; }
+    while(atomic_flag_test_and_set_explicit(&st->heap_lock,
+            memory_order_acquire))
+        ;
+    if(gone){ st->heap_held -= (long)_heap_forget(st, gone); }
+    if(got){
+        ++st->heap_allocs;
+        st->heap_bytes += (long)asked;
+        if(!_heap_remember(st, got, asked)){ st->heap_held += (long)asked; }
+    }
+    if(st->heap_held > st->heap_peak){ st->heap_peak = st->heap_held; }
+    atomic_flag_clear_explicit(&st->heap_lock, memory_order_release);
+}
+
+/* Called by the hooks of mtsuite_heap.c, which the program links in to
+ * interpose them; they call it only while mtsuite_heap_runners says some
+ * runner counts. */
+void mtsuite_heap_note(const void *got, size_t asked, const void *gone){
+    _heap_note(got, asked, gone);
+}
+
+/* Defined by mtsuite_heap.c: whether its hooks are linked in. */
+extern const int mtsuite_heap_hooks __attribute__((weak));
+#else
+#define runner_realloc realloc
+#define runner_free free
+#endif
+
+/* Start counting the running test's allocations, if --heap asks for it. */
+static void _heap_arm(void){
+    struct TestState *st = _state();
+    if(!_runner()->opt_heap){ return; }
+    st->heap_allocs = st->heap_bytes = st->heap_held = st->heap_peak = 0;
+    if(st->heap_n){
+        memset(st->heap_blocks, 0, st->heap_cap * sizeof(*st->heap_blocks));
+        st->heap_n = 0;
+    }
+    st->heap_armed = 1;
+}
+
+static void _heap_disarm(struct TestResult *res){
+    struct TestState *st = _state();
+    if(!_runner()->opt_heap){ return; }
+    st->heap_armed = 0;
+    /* Wait out a helper thread still counting. */
+    while(atomic_flag_test_and_set_explicit(&st->heap_lock,
+            memory_order_acquire))
+        ;
+    res->heap.allocs = st->heap_allocs;
+    res->heap.bytes = st->heap_bytes;
+    res->heap.peak = st->heap_peak;
+    res->heap.leaked = st->heap_held;
+    atomic_flag_clear_explicit(&st->heap_lock, memory_order_release);
+}
+
+/* Performance counters.  Each thread that runs tests opens a group of
+ * counters on itself, once per process: the hardware set if the kernel
+ * lets us, else the software set.  A counter the machine lacks is left
+ * out of the group; if no leader opens at all, tests run uncounted. */
+struct CounterDesc {
+    const char *name;
+    unsigned type;
+    unsigned long long config;
+};
+
+#ifdef __linux__
+#define MTSUITE_CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct CounterDesc counter_descs[MTSUITE_N_COUNTERS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "L1d-misses", PERF_TYPE_HW_CACHE,
+        MTSUITE_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { "LLC-misses", PERF_TYPE_HW_CACHE,
+        MTSUITE_CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+    { "task-clock-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+/* counter_descs[0..5) are the hardware set, [5..9) the software set. */
+#define MTSUITE_N_HW_COUNTERS   5
+#endif
+
+static void _counters_close(struct TestState *st){
+    int i;
+    for(i=0; st->perf_pid && i < st->perf_n; ++i){
+        close(st->perf_fds[i]);
+    }
+    st->perf_n = 0;
+    st->perf_mode = COUNTERS_NONE;
+    st->perf_pid = 0;
+}
+
+#ifdef __linux__
+/* Open counter `which` on this thread, in `group` unless that is -1.  Kernel
+ * events are left out if perf_event_paranoid forbids them. */
+static int _counter_open(int which, int group){
+    struct perf_event_attr attr;
+    int fd, pass;
+    for(pass=0; pass < 2; ++pass){
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_descs[which].type;
+        attr.config = counter_descs[which].config;
+        attr.disabled = group == -1;
+        attr.exclude_kernel = pass;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group,
+            PERF_FLAG_FD_CLOEXEC);
+        if(fd != -1 || errno != EACCES){ break; }
+    }
+    return fd;
+}
+
+/* Open the counters from `first` to `last` as a group.  Returns 0 if at
+ * least the leader opened. */
+static int _counters_open_set(struct TestState *st, int first, int last){
+    int i;
+    st->perf_n = 0;
+    for(i=first; i < last; ++i){
+        int fd = _counter_open(i, st->perf_n ? st->perf_fds[0] : -1);
+        if(fd == -1){
+            if(!st->perf_n){ return -1; }
+            continue;
+        }
+        st->perf_fds[st->perf_n] = fd;
+        st->perf_which[st->perf_n++] = i;
+    }
+    return 0;
+}
+#endif
+
+/* Make sure this thread's counters are open in this process; a forked child
+ * inherits descriptors that count its parent. */
+static void _counters_open(struct TestState *st){
+    pid_t pid = getpid();
+    if(st->perf_pid == pid){ return; }
+    _counters_close(st);
+    st->perf_pid = pid;
+#ifdef __linux__
+    if(!_counters_open_set(st, 0, MTSUITE_N_HW_COUNTERS)){
+        st->perf_mode = COUNTERS_HARDWARE;
+        return;
+    }
+    _runner()->counters_errno = errno;
+    if(!_counters_open_set(st, MTSUITE_N_HW_COUNTERS, MTSUITE_N_COUNTERS)){
+        st->perf_mode = COUNTERS_SOFTWARE;
+    }
+#else
+    _runner()->counters_errno = ENOSYS;
+#endif
+}
+
+/* Zero the running test's counters and start them. */
+static void _counters_begin(void){
+    struct TestState *st = _state();
+    if(!_runner()->opt_counters){ return; }
+    _counters_open(st);
+#ifdef __linux__
+    if(st->perf_n){
+        ioctl(st->perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(st->perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+/* Stop the counters and put what they counted over `ops` benchmark
+ * iterations (0 for a plain test) into `res`. */
+static void _counters_end(struct TestResult *res, double ops){
+    struct TestState *st = _state();
+    struct CounterStats *cs = &res->counters;
+    if(!_runner()->opt_counters){ return; }
+    cs->mode = st->perf_mode;
+    cs->ops = ops;
+    cs->present = 0;
+#ifdef __linux__
+    if(st->perf_n){
+        unsigned long long buf[3 + MTSUITE_N_COUNTERS];
+        ssize_t r;
+        ioctl(st->perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        r = read(st->perf_fds[0], buf, sizeof(buf));
+        /* nr, time enabled, time running, then a value per counter. */
+        if(r >= (ssize_t)(3 * sizeof(*buf)) && buf[2]){
+            double scale = (double)buf[1] / buf[2];
+            unsigned long long i;
+            for(i=0; i < buf[0] && i < (unsigned long long)st->perf_n; ++i){
+                cs->value[st->perf_which[i]] = buf[3 + i] * scale;
+                cs->present |= 1u << st->perf_which[i];
+            }
+        }
+    }
+#endif
+}
+
+/* Trace timeline.  Every span is a binary record in the buffer of the
+ * thread that saw it: a TraceRecord, then its name.  Nothing is formatted
+ * until the run is over.  A child sends its records back after its
+ * messages, and the parent files them under the child's track.  Tracks are
+ * 0 for the main thread, then one per --threads worker, then one per job
+ * or pool worker. */
+enum TraceKind { TRACE_TEST, TRACE_PHASE, TRACE_USER, TRACE_RUNNER };
+
+struct TraceRecord {
+    double ts, dur;         /* monotonic seconds */
+    int track;
+    unsigned short name_len;
+    unsigned char kind;     /* enum TraceKind */
+};
+
+static void _trace_add(
+    struct TestState *st, int kind, const char *name, size_t name_len,
+    double ts, double dur, int track
+){
+    struct TraceRecord rec;
+    if(name_len >= MTSUITE_MAX_NAMELEN){ name_len = MTSUITE_MAX_NAMELEN - 1; }
+    pthread_mutex_lock(&st->lock);
+    if(st->trace_len + sizeof(rec) + name_len > st->trace_cap){
+        size_t cap = st->trace_cap ? st->trace_cap : 4096;
+        char *buf;
+        while(cap < st->trace_len + sizeof(rec) + name_len){ cap *= 2; }
+        if(!(buf = runner_realloc(st->trace, cap))){
+            pthread_mutex_unlock(&st->lock);
+            return;
+        }
+        st->trace = buf;
+        st->trace_cap = cap;
+    }
+    rec.ts = ts;
+    rec.dur = dur;
+    rec.track = track;
+    rec.name_len = (unsigned short)name_len;
+    rec.kind = (unsigned char)kind;
+    memcpy(st->trace + st->trace_len, &rec, sizeof(rec));
+    memcpy(st->trace + st->trace_len + sizeof(rec), name, name_len);
+    st->trace_len += sizeof(rec) + name_len;
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* A span from `t0` to `t1` on this thread's track. */
+static void _trace_span(int kind, const char *name, double t0, double t1){
+    struct TestState *st = _state();
+    if(!_runner()->opt_trace){ return; }
+    _trace_add(st, kind, name, strlen(name), t0, t1 - t0, st->trace_track);
+}
+
+/* File the `len` bytes of records `blob` from a child under `track`. */
+static void _trace_merge(const char *blob, size_t len, int track){
+    struct TraceRecord rec;
+    size_t off = 0;
+    while(len - off >= sizeof(rec)){
+        memcpy(&rec, blob + off, sizeof(rec));
+        if(len - off - sizeof(rec) < rec.name_len){ break; }
+        _trace_add(_state(), rec.kind, blob + off + sizeof(rec),
+            rec.name_len, rec.ts, rec.dur, track);
+        off += sizeof(rec) + rec.name_len;
+    }
+}
+
+static void _state_enter(const Testgroup_t *group, const Testcase_t *tcase){
+    struct TestState *st = _state();
+    pthread_mutex_lock(&st->lock);
+    st->group = group;
+    st->prefix = group->prefix;
+    st->name = tcase->name;
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* Print for the running test: into its capture buffer on a --threads
+ * worker, otherwise to stdout (which may be captured itself). */
+static void _test_vprintf(const char *fmt, va_list ap){
+    struct TestState *st = cur_state;
+    va_list ap2;
+    int n;
+    if(!st || !_runner()->opt_capture){
+        vprintf(fmt, ap);
+        return;
+    }
+    va_copy(ap2, ap);
+    n = vsnprintf(NULL, 0, fmt, ap2);
+    va_end(ap2);
+    if(n < 0){ return; }
+    if(st->out_len + n + 1 > st->out_cap){
+        size_t cap = st->out_cap ? st->out_cap : 1024;
+        char *out;
+        while(cap < st->out_len + n + 1){ cap *= 2; }
+        if(!(out = runner_realloc(st->out, cap))){ return; }
+        st->out = out;
+        st->out_cap = cap;
+    }
+    vsnprintf(st->out + st->out_len, n + 1, fmt, ap);
+    st->out_len += n;
+}
+
+static void _test_printf(const char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    _test_vprintf(fmt, ap);
+    va_end(ap);
+}
+
+/* Make room for `len` more message bytes; st->lock must be held. */
+static int _messages_reserve(struct TestState *st, size_t len){
+    if(st->msg_len + len > MTSUITE_MAX_MESSAGES){ return -1; }
+    if(st->msg_len + len > st->msg_cap){
+        size_t cap = st->msg_cap ? st->msg_cap : 1024;
+        char *buf;
+        while(cap < st->msg_len + len){ cap *= 2; }
+        if(!(buf = runner_realloc(st->msg_buf, cap))){ return -1; }
+        st->msg_buf = buf;
+        st->msg_cap = cap;
+    }
+    return 0;
+}
+
+static void _messages_append(const char *s, size_t len){
+    struct TestState *st = _state();
+    pthread_mutex_lock(&st->lock);
+    if(!_messages_reserve(st, len)){
+        memcpy(st->msg_buf + st->msg_len, s, len);
+        st->msg_len += len;
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* Add one whole record, so that helper threads cannot interleave theirs. */
+static void _messages_record(const char *file, int line, const char *text){
+    struct TestState *st = _state();
+    char linebuf[16];
+    size_t flen = strlen(file) + 1, tlen = strlen(text) + 1, llen;
+    llen = snprintf(linebuf, sizeof(linebuf), "%d", line) + 1;
+    pthread_mutex_lock(&st->lock);
+    if(!_messages_reserve(st, flen + llen + tlen)){
+        char *cp = st->msg_buf + st->msg_len;
+        memcpy(cp, file, flen);
+        memcpy(cp + flen, linebuf, llen);
+        memcpy(cp + flen + llen, text, tlen);
+        st->msg_len += flen + llen + tlen;
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* Record a failure message that comes from the runner, not from a test
+ * assertion; it has no file and line. */
+static void _messages_note(const char *text){
+    _messages_record("", 0, text);
+}
+
+static void _messages_reset(void){
+    struct TestState *st = _state();
+    pthread_mutex_lock(&st->lock);
+    st->msg_len = 0;
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* Point `res` at the messages recorded so far. */
+static void _messages_get(struct TestResult *res){
+    struct TestState *st = _state();
+    pthread_mutex_lock(&st->lock);
+    res->messages = st->msg_buf;
+    res->messages_len = st->msg_len;
+    pthread_mutex_unlock(&st->lock);
+}
+
+static int _cmp_double(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Median of `n` values; sorts `v` in place. */
+static double _median(double *v, int n){
+    qsort(v, n, sizeof(*v), _cmp_double);
+    return (n & 1) ? v[n/2] : (v[n/2 - 1] + v[n/2]) / 2;
+}
+
+static void _bench_stats(struct BenchStats *st){
+    double sorted[MTSUITE_MAX_BENCH_ROUNDS];
+    double sum = 0;
+    int i, n = st->n_samples;
+    if(!n){ return; }
+    for(i=0; i < n; ++i){
+        sum += st->samples[i];
+    }
+    st->mean = sum / n;
+    for(i=0, sum=0; i < n; ++i){
+        sum += (st->samples[i] - st->mean) * (st->samples[i] - st->mean);
+    }
+    st->cv = n > 1 && st->mean > 0 ? sqrt(sum / (n - 1)) / st->mean * 100 : 0;
+    memcpy(sorted, st->samples, n * sizeof(*sorted));
+    st->median = _median(sorted, n);
+    st->min = sorted[0];
+    for(i=0; i < n; ++i){
+        sorted[i] = st->samples[i] > st->median ?
+            st->samples[i] - st->median : st->median - st->samples[i];
+    }
+    st->mad = _median(sorted, n);
+}
+
+/* Time one round of `iters` iterations, in seconds. */
+static double _bench_round(
+    const Testcase_t *tcase, void *env, unsigned long iters
+){
+    double t0 = _monotonic_now();
+    tcase->bench(env, iters);
+    return _monotonic_now() - t0;
+}
+
+/* Benchmark isolation: while a benchmark runs, the thread running it is
+ * pinned to --bench-cpus and, with --bench-priority, given the highest
+ * priority it is allowed.  Both are put back afterwards. */
+
+struct BenchIsolation {
+    int pinned;
+    int reniced, old_nice;
+#ifdef __linux__
+    cpu_set_t old_cpus;
+#endif
+};
+
+/* Keep a copy of `value` in *field, an option's string the runner owns:
+ * the caller's need not outlive the call. */
+static int _option_copy(char **field, const char *value){
+    char *copy = strdup(value);
+    if(!copy){
+        perror("copying option");
+        return -1;
+    }
+    free(*field);
+    *field = copy;
+    return 0;
+}
+
+/* Parse a CPU list such as "2" or "0-3,6" into bench_cpus. */
+static int _bench_parse_cpus(const char *arg, const char *list){
+#ifdef __linux__
+    Testrunner_t *run = _runner();
+    const char *cp = list;
+    CPU_ZERO(&run->bench_cpus);
+    while(*cp){
+        char *endp;
+        long lo = strtol(cp, &endp, 10), hi = lo;
+        if(endp == cp || lo < 0){ break; }
+        if(*endp == '-'){
+            cp = endp + 1;
+            hi = strtol(cp, &endp, 10);
+            if(endp == cp || hi < lo){ break; }
+        }
+        if(hi >= CPU_SETSIZE){ break; }
+        for(; lo <= hi; ++lo){ CPU_SET(lo, &run->bench_cpus); }
+        cp = endp;
+        if(*cp == ','){
+            ++cp;
+        }else if(*cp){
+            break;
+        }
+    }
+    if(!*cp && CPU_COUNT(&run->bench_cpus)){
+        return _option_copy(&run->opt_bench_cpus, list);
+    }
+#else
+    (void)list;
+#endif
+    printf("Bad value in %s. Try --help\n", arg);
+    return -1;
+}
+
+static void _bench_isolate(struct BenchIsolation *iso){
+    Testrunner_t *run = _runner();
+    memset(iso, 0, sizeof(*iso));
+#ifdef __linux__
+    if(run->opt_bench_cpus && !sched_getaffinity(0, sizeof(iso->old_cpus),
+            &iso->old_cpus)){
+        static int warned = 0;
+        iso->pinned = !sched_setaffinity(0, sizeof(run->bench_cpus),
+            &run->bench_cpus);
+        if(!iso->pinned && !warned++){
+            printf("[cannot pin to --bench-cpus=%s: %s] ", run->opt_bench_cpus,
+                strerror(errno));
+        }
+    }
+#endif
+    if(run->opt_bench_priority){
+        int nice;
+        errno = 0;
+        iso->old_nice = getpriority(PRIO_PROCESS, 0);
+        if(errno){ return; }
+        /* Without privileges RLIMIT_NICE caps how far we may go. */
+        for(nice = -20; nice < iso->old_nice; ++nice){
+            if(!setpriority(PRIO_PROCESS, 0, nice)){
+                iso->reniced = 1;
+                break;
+            }
+        }
+    }
+}
+
+static void _bench_unisolate(const struct BenchIsolation *iso){
+#ifdef __linux__
+    if(iso->pinned){
+        sched_setaffinity(0, sizeof(iso->old_cpus), &iso->old_cpus);
+    }
+#endif
+    if(iso->reniced){
+        setpriority(PRIO_PROCESS, 0, iso->old_nice);
+    }
+}
+
+static int _bench_cpu(void){
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+static long _thread_nivcsw(void){
+    struct rusage ru;
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &ru);
+#else
+    getrusage(RUSAGE_SELF, &ru);
+#endif
+    return ru.ru_nivcsw;
+}
+
+/* Run the warmup rounds and then `rounds` measured ones into `st`, noting
+ * CPU changes and preemptions on the way.  Returns -1 if the benchmark
+ * reported a failure. */
+static int _bench_measure(
+    const Testcase_t *tcase, void *env, unsigned long iters, int rounds,
+    struct BenchStats *st, struct TestResult *res
+){
+    long nivcsw;
+    int i, cpu;
+    double t;
+    for(i=0; i < _runner()->opt_bench_warmup; ++i){
+        _bench_round(tcase, env, iters);
+        if(_state()->outcome != OK){ return -1; }
+    }
+    st->n_samples = 0;
+    st->migrations = 0;
+    cpu = _bench_cpu();
+    nivcsw = _thread_nivcsw();
+    _counters_begin();
+    for(i=0; i < rounds; ++i){
+        int now;
+        t = _bench_round(tcase, env, iters);
+        if(_state()->outcome != OK){ break; }
+        st->samples[st->n_samples++] = t * 1e9 / iters;
+        if((now = _bench_cpu()) != cpu){
+            ++st->migrations;
+            cpu = now;
+        }
+    }
+    _counters_end(res, (double)iters * (i < rounds ? i + 1 : rounds));
+    st->nivcsw = _thread_nivcsw() - nivcsw;
+    if(i < rounds){ return -1; }
+    _bench_stats(st);
+    /* A preemption every round or so is background load, not noise. */
+    st->noisy = st->cv > _runner()->opt_bench_max_cv || st->migrations ||
+        st->nivcsw > rounds;
+    return 0;
+}
+
+/* Grow the iteration count until one round takes opt_bench_time, then run
+ * the warmup and measurement rounds at that count.  A noisy measurement is
+ * made again up to opt_bench_retries times; if none is clean, the least
+ * varying one is kept and flagged.  Stops early if the benchmark reports a
+ * failure. */
+static void _testcase_run_bench(
+    const Testcase_t *tcase, void *env, struct TestResult *res
+){
+    Testrunner_t *run = _runner();
+    struct BenchStats *st = &res->bench;
+    struct BenchStats attempt;
+    struct CounterStats kept_counters = res->counters;
+    struct BenchIsolation iso;
+    unsigned long iters = 1;
+    double t;
+    int rounds = run->opt_bench_rounds;
+    _bench_isolate(&iso);
+    for(;;){
+        double grow;
+        t = _bench_round(tcase, env, iters);
+        if(_state()->outcome != OK){ goto end; }
+        if(t >= run->opt_bench_time || iters >= ULONG_MAX / 100){ break; }
+        /* Aim 20% past the target; grow at least 2x, at most 100x. */
+        grow = t > 0 ? run->opt_bench_time * 1.2 / t : 100;
+        grow = grow < 2 ? 2 : (grow > 100 ? 100 : grow);
+        iters = (unsigned long)(iters * grow);
+    }
+    if((run->baseline_out || run->baseline) &&
+            rounds < MTSUITE_MIN_BASELINE_ROUNDS){
+        rounds = MTSUITE_MIN_BASELINE_ROUNDS;
+    }
+    if(rounds > MTSUITE_MAX_BENCH_ROUNDS){ rounds = MTSUITE_MAX_BENCH_ROUNDS; }
+    st->iters = iters;
+    for(;;){
+        memset(&attempt, 0, sizeof(attempt));
+        attempt.iters = iters;
+        if(_bench_measure(tcase, env, iters, rounds, &attempt, res)){
+            *st = attempt;
+            break;
+        }
+        attempt.attempts = st->attempts + 1;
+        if(!st->n_samples || attempt.cv < st->cv || !attempt.noisy){
+            *st = attempt;
+            kept_counters = res->counters;
+        }else{
+            st->attempts = attempt.attempts;
+        }
+        if(!st->noisy || st->attempts > run->opt_bench_retries){
+            res->counters = kept_counters;
+            break;
+        }
+    }
+end:
+    _bench_unisolate(&iso);
+}
+
+/* Group fixtures, one slot per group of the groups array mtsuite_main was
+ * given.  A fixture is built in whichever process first runs a case of
+ * its group, so forked children inherit it built; the pool builds every
+ * fixture it will need before starting its workers.  `remaining` counts
+ * the group's selected cases not yet counted; the fixture is torn down
+ * when it reaches zero.  Its setup and cleanup have an arena of their own,
+ * which lives as long as the fixture. */
+struct GroupFixture {
+    void *env;
+    int tried;
+    enum Outcome built;     /* once tried: OK, or FAIL or SKIP from setup */
+    int remaining;
+    struct ArenaChunk *arena_head, *arena_cur;
+    size_t arena_used;
+};
+
+static struct GroupFixture *_fixture_of(const Testgroup_t *group){
+    Testrunner_t *run = _runner();
+    if(!group || !group->fixture || !run->fixtures ||
+            group < run->fixture_groups ||
+            group >= run->fixture_groups + run->n_fixtures){
+        return NULL;
+    }
+    return &run->fixtures[group - run->fixture_groups];
+}
+
+/* Trade this thread's arena for the fixture's, or back. */
+static void _fixture_arena_swap(struct GroupFixture *f){
+    struct TestState *st = _state();
+    struct ArenaChunk *head = st->arena_head, *cur = st->arena_cur;
+    size_t used = st->arena_used;
+    st->arena_head = f->arena_head;
+    st->arena_cur = f->arena_cur;
+    st->arena_used = f->arena_used;
+    f->arena_head = head;
+    f->arena_cur = cur;
+    f->arena_used = used;
+}
+
+/* Build `group`'s fixture unless that was tried already.  Returns OK when
+ * its cases may run (also when there is no fixture), or the outcome they
+ * get instead. */
+static enum Outcome _fixture_acquire(const Testgroup_t *group){
+    struct GroupFixture *f = _fixture_of(group);
+    enum Outcome built;
+    if(!f){ return OK; }
+    pthread_mutex_lock(&_runner()->fixture_lock);
+    if(!f->tried){
+        _fixture_arena_swap(f);
+        f->env = group->fixture->setup(group);
+        _fixture_arena_swap(f);
+        f->built = !f->env ? FAIL :
+            (f->env == (void*)MTSUITE_SKIP ? SKIP : OK);
+        f->tried = 1;
+    }
+    built = f->built;
+    pthread_mutex_unlock(&_runner()->fixture_lock);
+    return built;
+}
+
+static void _fixture_teardown(
+    const Testgroup_t *group, struct GroupFixture *f
+){
+    int cleaned = 1;
+    if(f->tried && f->built == OK){
+        _fixture_arena_swap(f);
+        cleaned = group->fixture->cleanup(group, f->env);
+        _fixture_arena_swap(f);
+    }
+    if(!cleaned){
+        printf("\n  [%s fixture cleanup FAILED]\n", group->prefix);
+        ++_runner()->n_bad;
+    }
+    while(f->arena_head){
+        struct ArenaChunk *next = f->arena_head->next;
+        runner_free(f->arena_head);
+        f->arena_head = next;
+    }
+    f->arena_cur = NULL;
+    f->arena_used = 0;
+    f->tried = 0;
+    f->env = NULL;
+}
+
+/* A case of `group` has been counted. */
+static void _fixture_release(const Testgroup_t *group){
+    struct GroupFixture *f = _fixture_of(group);
+    if(!f){ return; }
+    pthread_mutex_lock(&_runner()->fixture_lock);
+    if(f->remaining && !--f->remaining){
+        _fixture_teardown(group, f);
+    }
+    pthread_mutex_unlock(&_runner()->fixture_lock);
+}
+
+/* Tear down whatever is still built, e.g. in a spawned child. */
+static void _fixture_teardown_all(void){
+    Testrunner_t *run = _runner();
+    int i;
+    for(i=0; i < run->n_fixtures; ++i){
+        if(run->fixtures[i].tried){
+            _fixture_teardown(&run->fixture_groups[i], &run->fixtures[i]);
         }
     }
+}
+
+static void _heap_fail(const char *note){
+    mtsuite_set_test_failed();
+    _test_printf("\n  FAIL %s", note);
+    _messages_note(note);
+}
+
+/* What a heap budget allows, or -1 for no limit. */
+static long _heap_allowed(long budget){
+    if(!budget){ return -1; }
+    return budget == MTSUITE_NONE ? 0 : budget;
+}
+
+/* Hold a test that passed to its heap budgets.  Returns OK, or FAIL with a
+ * note saying which budget it broke. */
+static enum Outcome _heap_check(
+    const Testcase_t *tcase, const struct TestResult *res
+){
+    char note[96];
+    enum Outcome outcome = OK;
+    long allowed;
+    if(!_runner()->opt_heap){ return OK; }
+    allowed = _heap_allowed(tcase->max_allocs);
+    if(allowed >= 0 && res->heap.allocs > allowed){
+        snprintf(note, sizeof(note), "made %ld allocations (%ld allowed)",
+            res->heap.allocs, allowed);
+        _heap_fail(note);
+        outcome = FAIL;
+    }
+    allowed = _heap_allowed(tcase->max_heap);
+    if(allowed >= 0 && res->heap.bytes > allowed){
+        snprintf(note, sizeof(note), "allocated %ld bytes (%ld allowed)",
+            res->heap.bytes, allowed);
+        _heap_fail(note);
+        outcome = FAIL;
+    }
+    allowed = _heap_allowed(tcase->max_leak);
+    if(allowed >= 0 && res->heap.leaked > allowed){
+        snprintf(note, sizeof(note), "leaked %ld bytes (%ld allowed)",
+            res->heap.leaked, allowed);
+        _heap_fail(note);
+        outcome = FAIL;
+    }
+    return outcome;
+}
+
+/* Hand the whole arena back for the next test; its chunks stay. */
+static void _arena_reset(void){
+    struct TestState *st = _state();
+    st->arena_cur = st->arena_head;
+    st->arena_used = 0;
+}
+
+static void _arena_free(struct TestState *st){
+    while(st->arena_head){
+        struct ArenaChunk *next = st->arena_head->next;
+        free(st->arena_head);
+        st->arena_head = next;
+    }
+    st->arena_cur = NULL;
+    st->arena_used = 0;
+}
 
-    cur_test_outcome = OK;
-    tcase->callback(env);
-    outcome = cur_test_outcome;
+/* Get `tcase` ready to run: its group fixture, then its setup, with the
+ * heap armed from there on.  Returns OK, with its argument in *env, if the
+ * body is to run; otherwise how the test ended, all accounted for. */
+static enum Outcome _testcase_begin(
+    const Testcase_t *tcase, struct TestResult *res, void **env, double *t0
+){
+    const Testgroup_t *group = _state()->group;
+    struct GroupFixture *f = _fixture_of(group);
+    _messages_reset();
+    _state()->trace_depth = 0;
+    *env = NULL;
+    *t0 = _monotonic_now();
+    if(f){
+        enum Outcome built = _fixture_acquire(group);
+        if(built != OK){
+            if(built == FAIL){ _messages_note("group fixture setup failed"); }
+            res->t_setup = _monotonic_now() - *t0;
+            _messages_get(res);
+            return built;
+        }
+        *env = f->env;
+    }
+    _heap_arm();
+    if(tcase->config){
+        *env = tcase->config->setup(tcase);
+        if(!*env || *env == (void*)MTSUITE_SKIP){
+            _heap_disarm(res);
+            _arena_reset();
+            res->t_setup = _monotonic_now() - *t0;
+            _messages_get(res);
+            return *env ? SKIP : FAIL;
+        }
+    }
+    _state()->outcome = OK;
+    return OK;
+}
 
+/* Clean up after the body of `tcase`, which ran from t1 to t2 and ended
+ * with `outcome`, and return how the test ended. */
+static enum Outcome _testcase_end(
+    const Testcase_t *tcase, void *env, struct TestResult *res,
+    enum Outcome outcome, double t0, double t1, double t2
+){
     if(tcase->config){
         if(tcase->config->cleanup(tcase, env) == 0){
             outcome = FAIL;
         }
     }
+    _heap_disarm(res);
+    _arena_reset();
 
+    res->t_setup = t1 - t0;
+    res->t_callback = t2 - t1;
+    res->t_cleanup = _monotonic_now() - t2;
+    if(_runner()->opt_trace){
+        _trace_span(TRACE_PHASE, "setup", t0, t1);
+        _trace_span(TRACE_PHASE, "callback", t1, t2);
+        _trace_span(TRACE_PHASE, "cleanup", t2, t2 + res->t_cleanup);
+    }
+    if(outcome == OK){
+        outcome = _heap_check(tcase, res);
+    }
+    _messages_get(res);
     return outcome;
 }
 
-#define MTSUITE_MAGIC_EXIT_CODE 42
+static void _async_run_inline(const Testcase_t *tcase, void *env);
+
+static enum Outcome _testcase_run_bare(
+    const Testcase_t *tcase, struct TestResult *res
+){
+    void *env;
+    enum Outcome outcome;
+    double t0, t1, t2;
+    if((outcome = _testcase_begin(tcase, res, &env, &t0)) != OK){
+        return outcome;
+    }
 
+    t1 = _monotonic_now();
+    if(tcase->bench){
+        _testcase_run_bench(tcase, env, res);
+    }else if(tcase->async){
+        _async_run_inline(tcase, env);
+    }else{
+        _counters_begin();
+        tcase->callback(env);
+        _counters_end(res, 0);
+    }
+    outcome = _state()->outcome;
+    t2 = _monotonic_now();
+    return _testcase_end(tcase, env, res, outcome, t0, t1, t2);
+}
 
-static enum Outcome _testcase_run_forked(
-    const Testgroup_t* group, const Testcase_t *tcase
+static void _result_set_rusage(
+    struct TestResult *res, const struct rusage *before,
+    const struct rusage *after
 ){
-    int outpipe[2];
-    pid_t pid;
-    if(pipe(outpipe)){
-        perror("opening pipe");
+    res->utime = (after->ru_utime.tv_sec - before->ru_utime.tv_sec)
+        + (after->ru_utime.tv_usec - before->ru_utime.tv_usec) / 1e6;
+    res->stime = (after->ru_stime.tv_sec - before->ru_stime.tv_sec)
+        + (after->ru_stime.tv_usec - before->ru_stime.tv_usec) / 1e6;
+    res->maxrss = after->ru_maxrss;
+    res->nvcsw = after->ru_nvcsw - before->ru_nvcsw;
+    res->nivcsw = after->ru_nivcsw - before->ru_nivcsw;
+}
+
+/* Run `tcase` in this process.  Resource usage is the difference across the
+ * run; max RSS can only be the process-wide high-water mark. */
+static enum Outcome _testcase_run_inproc(
+    const Testcase_t *tcase, struct TestResult *res
+){
+    struct rusage before, after;
+#ifdef RUSAGE_THREAD
+    const int who = RUSAGE_THREAD;
+#else
+    const int who = RUSAGE_SELF;
+#endif
+    getrusage(who, &before);
+    res->outcome = _testcase_run_bare(tcase, res);
+    getrusage(who, &after);
+    _result_set_rusage(res, &before, &after);
+    return res->outcome;
+}
+
+#define MTSUITE_MAGIC_EXIT_CODE 42
+
+/* Deadline for one run of `tcase` in seconds, or 0 if it may run forever. */
+static double _testcase_timeout(const Testcase_t *tcase){
+    if(tcase->timeout){
+        return tcase->timeout > 0 ? tcase->timeout : 0;
+    }
+    return _runner()->opt_timeout;
+}
+
+/* Whether `tcase` needs a process of its own even without a deadline:
+ * asked for one, or has a memory cap that must not bind the runner. */
+static int _testcase_forks(const Testcase_t *tcase){
+    return (tcase->flags & MTSUITE_FORK) || tcase->max_memory;
+}
+
+/* In a child about to run `tcase`: cap its address space. */
+static void _memory_limit(const Testcase_t *tcase){
+    struct rlimit rl;
+    if(!tcase->max_memory || getrlimit(RLIMIT_AS, &rl)){ return; }
+    rl.rlim_cur = tcase->max_memory;
+    if(rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max){
+        rl.rlim_cur = rl.rlim_max;
+    }
+    if(setrlimit(RLIMIT_AS, &rl)){ perror("setrlimit"); }
+}
+
+/* One test running in a forked (or spawned) child.  The child reports its
+ * outcome as a single byte ('Y', 'N' or 'S') on the pipe, followed by its
+ * TestResult and its failure messages, then exits.  The parent collects
+ * everything up to EOF and only trusts the result's numbers, never its
+ * pointers, since a spawned child has an address space of its own. */
+struct ForkedChild {
+    const Testgroup_t *group;
+    const Testcase_t *tcase;
+    pid_t pid;
+    int fd;
+    double started;     /* monotonic */
+    double deadline;    /* monotonic; 0 = none */
+    int killed;         /* last signal sent by the watchdog, or 0 */
+    int own_group;      /* leads a process group the watchdog signals */
+    char *report;       /* everything received so far */
+    size_t n_report, report_cap;
+    int cap_fds[2];     /* its stdout and stderr, or -1 */
+    int track;          /* set by the caller before starting it */
+};
+
+static int _write_all(int fd, const void *buf, size_t len){
+    const char *cp = buf;
+    while(len){
+        ssize_t w = write(fd, cp, len);
+        if(w < 0){
+            if(errno == EINTR){ continue; }
+            return -1;
+        }
+        cp += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static int _write_report(
+    int fd, enum Outcome outcome, const struct TestResult *res
+){
+    char b = "NYS"[outcome];
+    return _write_all(fd, &b, 1) ||
+        _write_all(fd, res, sizeof(*res)) ||
+        _write_all(fd, res->messages, res->messages_len) ||
+        _write_all(fd, res->trace, res->trace_len);
+}
+
+/* Point `res` at this thread's trace records, to go with its report. */
+static void _trace_get(struct TestResult *res){
+    struct TestState *st = _state();
+    res->trace = st->trace;
+    res->trace_len = st->trace_len;
+}
+
+/* Output capture.  A test's stdout and stderr go to files of their own
+ * (memfds where there are any) and are copied to ours, with sendfile(),
+ * only if the test fails or with --verbose.  In-process tests share one
+ * pair that is emptied between tests.  A forked or spawned child gets a
+ * pair of its own, which the parent reads once it is done.  A pool worker
+ * writes into one pair for its whole life and reports where each test's
+ * output starts and ends; the parent punches out what it has shown.  Tests
+ * on --threads workers share our descriptors, so only what they print
+ * through mtsuite is captured, into a buffer per thread. */
+
+static int _capture_file(void){
+    FILE *f;
+    int fd;
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    if((fd = memfd_create("mtsuite-capture", MFD_CLOEXEC)) != -1){
+        return fd;
+    }
+#endif
+    if(!(f = tmpfile())){
+        perror("creating capture file");
+        return -1;
+    }
+    fd = fcntl(fileno(f), F_DUPFD_CLOEXEC, 3);
+    fclose(f);
+    return fd;
+}
+
+/* A fresh pair of capture files, or -1s when capture is off or fails. */
+/* A pipe whose ends are both close-on-exec: children spawned later must not
+ * hold it open.  Forked children still have it. */
+static int _pipe_cloexec(int fds[2]){
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if(pipe(fds)){ return -1; }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+static void _capture_pair(int fds[2]){
+    fds[0] = fds[1] = -1;
+    if(!_runner()->opt_capture){ return; }
+    if((fds[0] = _capture_file()) == -1){ return; }
+    if((fds[1] = _capture_file()) == -1){
+        close(fds[0]);
+        fds[0] = -1;
+    }
+}
+
+static void _capture_close_pair(int fds[2]){
+    if(fds[0] != -1){ close(fds[0]); }
+    if(fds[1] != -1){ close(fds[1]); }
+    fds[0] = fds[1] = -1;
+}
+
+static size_t _capture_size(int fd){
+    struct stat st;
+    return fstat(fd, &st) ? 0 : (size_t)st.st_size;
+}
+
+/* Copy `len` bytes at `off` in `from` to `to`, inside the kernel if it
+ * will. */
+static void _copy_range(int to, int from, off_t off, size_t len){
+    char buf[8192];
+#ifdef __linux__
+    while(len){
+        ssize_t n = sendfile(to, from, &off, len);
+        if(n < 0 && errno == EINTR){ continue; }
+        if(n <= 0){ break; }
+        len -= (size_t)n;
+    }
+#endif
+    while(len){
+        ssize_t n = pread(from, buf, len < sizeof(buf) ? len : sizeof(buf),
+            off);
+        if(n < 0 && errno == EINTR){ continue; }
+        if(n <= 0 || _write_all(to, buf, n)){ return; }
+        off += n;
+        len -= (size_t)n;
+    }
+}
+
+static void _capture_copy(int to, const struct Capture *cap){
+    if(!cap->len){ return; }
+    if(cap->text){
+        _write_all(to, cap->text, cap->len);
+    }else{
+        _copy_range(to, cap->fd, cap->off, cap->len);
+    }
+}
+
+/* Pass on the output of `res` if it should be seen, then let go of it. */
+static void _capture_show(const struct TestResult *res){
+    if(res->outcome == FAIL || res->outcome == TIMEOUT ||
+            _runner()->opt_verbosity > 1){
+        fflush(stdout);
+        _capture_copy(STDOUT_FILENO, &res->out);
+        fflush(stderr);
+        _capture_copy(STDERR_FILENO, &res->err);
+    }
+    if(res->out.owned){ close(res->out.fd); }
+    if(res->err.owned){ close(res->err.fd); }
+}
+
+/* Send this process's stdout and stderr to the in-process capture pair. */
+static void _capture_begin(void){
+    Testrunner_t *run = _runner();
+    int i;
+    /* Our descriptors are the whole process's; only mtsuite_main's run may
+     * move them. */
+    if(!run->opt_capture || !run->owns_process){ return; }
+    fflush(stdout);
+    fflush(stderr);
+    if(run->capture_fds[0] == -1){
+        _capture_pair(run->capture_fds);
+        if(run->capture_fds[0] == -1){ return; }
+        run->saved_fds[0] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        run->saved_fds[1] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+    }
+    for(i=0; i < 2; ++i){
+        if(ftruncate(run->capture_fds[i], 0) == 0){
+            lseek(run->capture_fds[i], 0, SEEK_SET);
+        }
+        dup2(run->capture_fds[i], i ? STDERR_FILENO : STDOUT_FILENO);
+    }
+}
+
+static void _capture_end(struct TestResult *res){
+    Testrunner_t *run = _runner();
+    if(!run->opt_capture || run->capture_fds[0] == -1){ return; }
+    fflush(stdout);
+    fflush(stderr);
+    dup2(run->saved_fds[0], STDOUT_FILENO);
+    dup2(run->saved_fds[1], STDERR_FILENO);
+    res->out.fd = run->capture_fds[0];
+    res->out.len = _capture_size(run->capture_fds[0]);
+    res->err.fd = run->capture_fds[1];
+    res->err.len = _capture_size(run->capture_fds[1]);
+}
+
+/* Flush what this runner has buffered before a fork or spawn, so that it
+ * is neither written twice nor out of order.  The program's other streams
+ * are its own business. */
+static void _runner_flush(void){
+    Testrunner_t *run = _runner();
+    fflush(stdout);
+    fflush(stderr);
+    if(run->report_out){ fflush(run->report_out); }
+    if(run->baseline_out){ fflush(run->baseline_out); }
+    if(run->durations_out){ fflush(run->durations_out); }
+}
+
+/* End a forked child with its own output written out, but neither what
+ * the program had buffered in its other streams nor its atexit handlers:
+ * those are the parent's to run. */
+static void _child_exit(int status){
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+/* In a child: point our stdout and stderr at the capture pair `fds`. */
+static void _capture_redirect(int fds[2]){
+    if(fds[0] == -1){ return; }
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+}
+
+static void _child_started(
+    const Testgroup_t *group, const Testcase_t *tcase,
+    struct ForkedChild *child, pid_t pid, int fd, int cap_fds[2]
+){
+    child->group = group;
+    child->tcase = tcase;
+    child->pid = pid;
+    child->fd = fd;
+    child->killed = 0;
+    child->report = NULL;
+    child->n_report = child->report_cap = 0;
+    child->deadline = _testcase_timeout(tcase);
+    if(child->deadline){
+        child->deadline += child->started;
+    }
+    child->cap_fds[0] = cap_fds[0];
+    child->cap_fds[1] = cap_fds[1];
+}
+
+/* With --isolation=spawn a test runs in a fresh copy of the program,
+ * started with posix_spawn() as "argv[0] --run-single=FULLNAME
+ * --result-fd=3".  It writes its report to this descriptor. */
+#define MTSUITE_SPAWN_FD 3
+
+static int _testcase_start_spawned(
+    const Testgroup_t *group, const Testcase_t *tcase,
+    struct ForkedChild *child
+){
+    Testrunner_t *run = _runner();
+    extern char **environ;
+    char name[MTSUITE_MAX_NAMELEN];
+    char bench_time[48], bench_rounds[32], bench_warmup[32];
+    char bench_max_cv[48], bench_retries[32], bench_cpus[MTSUITE_MAX_NAMELEN];
+    char arena_size[32], arena_chunk[32];
+    char result_fd[32];
+    char *args[20];
+    int n_args = 0;
+    int outpipe[2], cap[2];
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t pid;
+    int r;
+    snprintf(name, sizeof(name), "--run-single=%s%s",
+        group->prefix, tcase->name);
+    snprintf(bench_time, sizeof(bench_time), "--bench-time=%.17g",
+        run->opt_bench_time);
+    /* The child has no baseline, so pass on the rounds it would force. */
+    snprintf(bench_rounds, sizeof(bench_rounds), "--bench-rounds=%d",
+        (run->baseline_out || run->baseline) &&
+        run->opt_bench_rounds < MTSUITE_MIN_BASELINE_ROUNDS ?
+        MTSUITE_MIN_BASELINE_ROUNDS : run->opt_bench_rounds);
+    snprintf(bench_warmup, sizeof(bench_warmup), "--bench-warmup=%d",
+        run->opt_bench_warmup);
+    snprintf(bench_max_cv, sizeof(bench_max_cv), "--bench-max-cv=%.17g",
+        run->opt_bench_max_cv);
+    snprintf(bench_retries, sizeof(bench_retries), "--bench-retries=%d",
+        run->opt_bench_retries);
+    snprintf(bench_cpus, sizeof(bench_cpus), "--bench-cpus=%s",
+        run->opt_bench_cpus ? run->opt_bench_cpus : "");
+    snprintf(result_fd, sizeof(result_fd), "--result-fd=%d",
+        MTSUITE_SPAWN_FD);
+    args[n_args++] = run->self_argv0;
+    args[n_args++] = name;
+    args[n_args++] = result_fd;
+    if(tcase->bench){
+        args[n_args++] = bench_time;
+        args[n_args++] = bench_rounds;
+        args[n_args++] = bench_warmup;
+        args[n_args++] = bench_max_cv;
+        args[n_args++] = bench_retries;
+        if(run->opt_bench_cpus){
+            args[n_args++] = bench_cpus;
+        }
+        if(run->opt_bench_priority){
+            args[n_args++] = "--bench-priority";
+        }
+    }
+    if(*run->verbosity_flag){
+        args[n_args++] = (char*)run->verbosity_flag;
+    }
+    if(run->opt_heap){
+        args[n_args++] = "--heap";
+    }
+    if(run->opt_trace){
+        /* Record spans, but leave writing them to us. */
+        args[n_args++] = "--trace=";
+    }
+    if(run->opt_counters){
+        args[n_args++] = "--counters";
+    }
+    snprintf(arena_size, sizeof(arena_size), "--arena-size=%d",
+        run->opt_arena_size);
+    snprintf(arena_chunk, sizeof(arena_chunk), "--arena-chunk=%d",
+        run->opt_arena_chunk);
+    args[n_args++] = arena_size;
+    args[n_args++] = arena_chunk;
+    args[n_args] = NULL;
+
+    if(_pipe_cloexec(outpipe)){
+        perror("opening pipe");
+        return -1;
+    }
+    if(outpipe[1] == MTSUITE_SPAWN_FD){
+        /* dup2() onto itself would leave close-on-exec set. */
+        int fd = fcntl(outpipe[1], F_DUPFD_CLOEXEC, MTSUITE_SPAWN_FD + 1);
+        if(fd == -1){
+            perror("opening pipe");
+            close(outpipe[0]);
+            close(outpipe[1]);
+            return -1;
+        }
+        close(outpipe[1]);
+        outpipe[1] = fd;
+    }
+    _capture_pair(cap);
+    if((r = posix_spawnattr_init(&attr))){
+        errno = r;
+        perror("posix_spawn");
+        close(outpipe[0]);
+        close(outpipe[1]);
+        _capture_close_pair(cap);
+        return -1;
+    }
+    /* In a process group of its own, as a forked test with a deadline. */
+    if(_testcase_timeout(tcase)){
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+    }
+    if((r = posix_spawn_file_actions_init(&actions)) == 0){
+        r = posix_spawn_file_actions_adddup2(
+            &actions, outpipe[1], MTSUITE_SPAWN_FD);
+        if(!r && cap[0] != -1){
+            r = posix_spawn_file_actions_adddup2(
+                &actions, cap[0], STDOUT_FILENO);
+            if(!r){
+                r = posix_spawn_file_actions_adddup2(
+                    &actions, cap[1], STDERR_FILENO);
+            }
+        }
+        if(!r){
+            _runner_flush();
+            child->started = _monotonic_now();
+            r = strchr(run->self_exe, '/') ?
+                posix_spawn(&pid, run->self_exe, &actions, &attr, args,
+                    environ) :
+                posix_spawnp(&pid, run->self_exe, &actions, &attr, args,
+                    environ);
+            if(run->opt_trace){
+                _trace_add(_state(), TRACE_RUNNER, "spawn", 5, child->started,
+                    _monotonic_now() - child->started, child->track);
+            }
+        }
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    posix_spawnattr_destroy(&attr);
+    close(outpipe[1]);
+    if(r){
+        errno = r;
+        perror("posix_spawn");
+        close(outpipe[0]);
+        _capture_close_pair(cap);
+        return -1;
+    }
+    _child_started(group, tcase, child, pid, outpipe[0], cap);
+    child->own_group = _testcase_timeout(tcase) != 0;
+    return 0;
+}
+
+static int _testcase_start_forked(
+    const Testgroup_t *group, const Testcase_t *tcase,
+    struct ForkedChild *child
+){
+    Testrunner_t *run = _runner();
+    int own_group = _testcase_timeout(tcase) != 0;
+    int outpipe[2], cap[2];
+    pid_t pid;
+    if(run->opt_isolation == ISOLATE_SPAWN){
+        return _testcase_start_spawned(group, tcase, child);
+    }
+    /* Build the group fixture here, so that the child inherits it. */
+    _fixture_acquire(group);
+    if(_pipe_cloexec(outpipe)){
+        perror("opening pipe");
+        return -1;
+    }
+
+    _capture_pair(cap);
+    _runner_flush();
+    child->started = _monotonic_now();
+    pid = fork();
+    if(pid == -1){
+        perror("fork");
+        close(outpipe[0]);
+        close(outpipe[1]);
+        _capture_close_pair(cap);
+        return -1;
+    }
+    if(!pid){
+        /* child */
+        int testr;
+        struct TestResult res;
+        if(own_group){ setpgid(0, 0); }
+        close(outpipe[0]);
+        if(run->worker_fds[0] != -1){
+            close(run->worker_fds[0]);
+            close(run->worker_fds[1]);
+        }
+        _capture_redirect(cap);
+        _state_enter(group, tcase);
+        _memory_limit(tcase);
+        /* Only this test's spans go back to the parent. */
+        _state()->trace_len = 0;
+        memset(&res, 0, sizeof(res));
+        testr = _testcase_run_bare(tcase, &res);
+        assert(0<=(int)testr && (int)testr<= 2);
+        _trace_get(&res);
+        fflush(stdout);
+        if(_write_report(outpipe[1], testr, &res)){
+            perror("write outcome to pipe");
+            _child_exit(1);
+        }
+        _child_exit(0);
+    }
+
+    /* parent */
+    /* The watchdog signals the whole process group, so that whatever the
+     * test started goes too.  Both sides set it, so that it is in place
+     * whichever runs first. */
+    if(own_group){ setpgid(pid, pid); }
+    if(run->opt_trace){
+        _trace_add(_state(), TRACE_RUNNER, "fork", 4, child->started,
+            _monotonic_now() - child->started, child->track);
+    }
+    close(outpipe[1]);
+    _child_started(group, tcase, child, pid, outpipe[0], cap);
+    child->own_group = own_group;
+    return 0;
+}
+
+/* Read whatever the child has sent.  Returns 1 once the pipe hits EOF. */
+static int _drain_child(struct ForkedChild *child){
+    char buf[512];
+    ssize_t r;
+    do{
+        r = read(child->fd, buf, sizeof(buf));
+    }while(r == -1 && errno == EINTR);
+    if(r < 0){
+        perror("read outcome from pipe");
+        return 1;
+    }
+    if(r > 0){
+        if(child->n_report + r > child->report_cap){
+            size_t cap = child->report_cap ? child->report_cap * 2 :
+                1 + sizeof(struct TestResult) + sizeof(buf);
+            char *report = realloc(child->report, cap);
+            if(!report){
+                perror("reading outcome from pipe");
+                return 1;
+            }
+            child->report = report;
+            child->report_cap = cap;
+        }
+        memcpy(child->report + child->n_report, buf, r);
+        child->n_report += r;
+    }
+    return r == 0;
+}
+
+/* Reap a child whose pipe has hit EOF (or that was sent SIGKILL) and fill
+ * in `res` from its report and its rusage. */
+static enum Outcome _testcase_finish_forked(
+    struct ForkedChild *child, struct TestResult *res
+){
+    struct rusage ru;
+    int status, r;
+    char b = child->n_report ? child->report[0] : 'N';
+    char note[64];
+    _messages_reset();
+    close(child->fd);
+    child->fd = -1;
+    if(!child->n_report && !child->killed){
+        printf("[Lost connection!] ");
+    }
+    if(child->n_report >= 1 + sizeof(struct TestResult)){
+        struct TestResult theirs;
+        memcpy(&theirs, child->report + 1, sizeof(theirs));
+        res->t_setup = theirs.t_setup;
+        res->t_callback = theirs.t_callback;
+        res->t_cleanup = theirs.t_cleanup;
+        res->bench = theirs.bench;
+        res->heap = theirs.heap;
+        res->counters = theirs.counters;
+        if(theirs.messages_len + theirs.trace_len ==
+                child->n_report - 1 - sizeof(struct TestResult)){
+            _messages_append(child->report + 1 + sizeof(theirs),
+                theirs.messages_len);
+            if(_runner()->opt_trace){
+                _trace_merge(child->report + 1 + sizeof(theirs) +
+                    theirs.messages_len, theirs.trace_len, child->track);
+            }
+        }
+    }
+    free(child->report);
+    child->report = NULL;
+    do{
+        r = wait4(child->pid, &status, 0, &ru);
+    }while(r == -1 && errno == EINTR);
+    res->t_wall = _monotonic_now() - child->started;
+    res->t_begin = child->started;
+    res->track = child->track;
+    if(child->cap_fds[0] != -1){
+        res->out.fd = child->cap_fds[0];
+        res->out.len = _capture_size(res->out.fd);
+        res->err.fd = child->cap_fds[1];
+        res->err.len = _capture_size(res->err.fd);
+        res->out.owned = res->err.owned = 1;
+        child->cap_fds[0] = child->cap_fds[1] = -1;
+    }
+    if(r == -1){
+        perror("waitpid");
+        _messages_get(res);
+        return res->outcome = FAIL;
+    }
+    {
+        struct rusage zero;
+        memset(&zero, 0, sizeof(zero));
+        _result_set_rusage(res, &zero, &ru);
+    }
+    if(child->killed){
+        /* Whatever it managed to report, it ran past its deadline. */
+        snprintf(note, sizeof(note), "timed out after %.3f s", res->t_wall);
+        _messages_note(note);
+        res->outcome = TIMEOUT;
+    }else if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        printf("[did not exit cleanly.]");
+        if(WIFSIGNALED(status)){
+            snprintf(note, sizeof(note), "killed by signal %d",
+                WTERMSIG(status));
+        }else{
+            snprintf(note, sizeof(note), "exited with status %d",
+                WEXITSTATUS(status));
+        }
+        _messages_note(note);
+        res->outcome = FAIL;
+    }else{
+        res->outcome = b == 'Y' ? OK : (b == 'S' ? SKIP : FAIL);
+    }
+    _messages_get(res);
+    return res->outcome;
+}
+
+/* Wait until one of the `n_slots` children (those with fd != -1) is done,
+ * enforcing deadlines on the way: an overdue child gets SIGTERM, then
+ * SIGKILL MTSUITE_KILL_GRACE seconds later.  Returns the finished slot, or
+ * -1 if no child is running.  `pfds` and `slot_of` are n_slots long.
+ * If waiting itself fails, the runner is broken and each child is killed
+ * in turn. */
+static int _wait_for_child(
+    struct ForkedChild *children, int n_slots,
+    struct pollfd *pfds, int *slot_of
+){
+    for(;;){
+        double now = _monotonic_now(), next = 0;
+        int n_fds = 0, timeout_ms = -1, i, r;
+        for(i=0; i < n_slots; ++i){
+            struct ForkedChild *child = &children[i];
+            if(child->fd == -1){ continue; }
+            if(_runner()->broken){
+                kill(child->own_group ? -child->pid : child->pid, SIGKILL);
+                return i;
+            }
+            if(child->deadline && now >= child->deadline){
+                pid_t target = child->own_group ? -child->pid : child->pid;
+                if(child->killed == SIGTERM){
+                    kill(target, SIGKILL);
+                    child->killed = SIGKILL;
+                    return i;
+                }
+                kill(target, SIGTERM);
+                child->killed = SIGTERM;
+                child->deadline = now + MTSUITE_KILL_GRACE;
+            }
+            if(child->deadline && (!next || child->deadline < next)){
+                next = child->deadline;
+            }
+            pfds[n_fds].fd = child->fd;
+            pfds[n_fds].events = POLLIN;
+            pfds[n_fds].revents = 0;
+            slot_of[n_fds++] = i;
+        }
+        if(!n_fds){ return -1; }
+        if(next){ timeout_ms = _poll_timeout(next - now); }
+        r = poll(pfds, n_fds, timeout_ms);
+        _trace_span(TRACE_RUNNER, "wait", now, _monotonic_now());
+        if(r == -1){
+            if(errno != EINTR){
+                perror("poll");
+                _runner()->broken = 1;
+            }
+            continue;
+        }
+        for(i=0; i < n_fds; ++i){
+            if(pfds[i].revents && _drain_child(&children[slot_of[i]])){
+                return slot_of[i];
+            }
+        }
+    }
+}
+
+static enum Outcome _testcase_run_forked(
+    const Testgroup_t* group, const Testcase_t *tcase,
+    struct TestResult *res
+){
+    struct ForkedChild child;
+    struct pollfd pfd;
+    int slot;
+    child.track = _state()->trace_track;
+    if(_testcase_start_forked(group, tcase, &child)){
+        return res->outcome = FAIL;
+    }
+    _wait_for_child(&child, 1, &pfd, &slot);
+    return _testcase_finish_forked(&child, res);
+}
+
+/* Keep the opt_slowest longest-running results, longest first. */
+static void _note_slowest(const struct TestResult *res){
+    Testrunner_t *run = _runner();
+    int i;
+    /* Benchmarks run for as long as they are told to. */
+    if(!run->opt_slowest || res->tcase->bench){ return; }
+    if(!run->slowest &&
+            !(run->slowest = calloc(run->opt_slowest, sizeof(*run->slowest)))){
+        return;
+    }
+    if(run->n_slowest == run->opt_slowest &&
+            res->t_wall <= run->slowest[run->n_slowest-1].t_wall){
+        return;
+    }
+    i = run->n_slowest < run->opt_slowest ?
+        run->n_slowest++ : run->n_slowest-1;
+    for(; i > 0 && run->slowest[i-1].t_wall < res->t_wall; --i){
+        run->slowest[i] = run->slowest[i-1];
+    }
+    run->slowest[i] = *res;
+    run->slowest[i].messages = NULL;
+    run->slowest[i].messages_len = 0;
+}
+
+static void _print_heap(const struct TestResult *res){
+    printf(" [heap: %ld allocs, %ld bytes, peak %ld, leaked %ld]",
+        res->heap.allocs, res->heap.bytes, res->heap.peak, res->heap.leaked);
+}
+
+/* Counters next to the result: totals for a test, per iteration for a
+ * benchmark, and instructions per cycle if both were counted. */
+static void _print_counters(const struct TestResult *res){
+#ifdef __linux__
+    const struct CounterStats *cs = &res->counters;
+    const char *sep = " [";
+    int i;
+    if(!cs->present){ return; }
+    for(i=0; i < MTSUITE_N_COUNTERS; ++i){
+        double v = cs->value[i];
+        if(!(cs->present & (1u << i))){ continue; }
+        if(cs->ops){
+            printf("%s%.3g %s/op", sep, v / cs->ops, counter_descs[i].name);
+        }else if(v >= 1e9){
+            printf("%s%.2fG %s", sep, v / 1e9, counter_descs[i].name);
+        }else if(v >= 1e6){
+            printf("%s%.2fM %s", sep, v / 1e6, counter_descs[i].name);
+        }else if(v >= 1e4){
+            printf("%s%.2fk %s", sep, v / 1e3, counter_descs[i].name);
+        }else{
+            printf("%s%.0f %s", sep, v, counter_descs[i].name);
+        }
+        sep = ", ";
+    }
+    if((cs->present & 3) == 3 && cs->value[0] > 0){
+        printf(", IPC %.2f", cs->value[1] / cs->value[0]);
+    }
+    putchar(']');
+#else
+    (void)res;  /* nothing is ever counted */
+#endif
+}
+
+static void _print_bench(const struct TestResult *res){
+    const struct BenchStats *st = &res->bench;
+    printf("%lu x %.2f ns/op (median %.2f, min %.2f, mad %.2f, cv %.1f%%)",
+        st->iters, st->mean, st->median, st->min, st->mad, st->cv);
+    if(res->tcase->bytes && st->median > 0){
+        printf(" %.2f MB/s", res->tcase->bytes * 1e3 / st->median);
+    }
+    if(st->noisy){
+        printf(" NOISY (%d attempts, %d migrations, %ld preemptions)",
+            st->attempts, st->migrations, st->nivcsw);
+    }
+}
+
+/* Benchmark baselines.  A baseline file is the magic "MTSB1\n" followed by
+ * one record per benchmark, in native byte order:
+ *     uint16 name length, name (prefix + name, no NUL),
+ *     uint16 sample count, float samples (ns/op) */
+#define MTSUITE_BASELINE_MAGIC "MTSB1\n"
+
+static int _cmp_baseline(const void *a, const void *b){
+    return strcmp(((const struct BaselineEntry*)a)->name,
+        ((const struct BaselineEntry*)b)->name);
+}
+
+static int _baseline_open_output(const char *fname){
+    if(!(_runner()->baseline_out = fopen(fname, "wbe"))){
+        perror(fname);
+        return -1;
+    }
+    fputs(MTSUITE_BASELINE_MAGIC, _runner()->baseline_out);
+    return 0;
+}
+
+static int _baseline_load(const char *fname){
+    Testrunner_t *run = _runner();
+    char magic[sizeof(MTSUITE_BASELINE_MAGIC) - 1];
+    FILE *f = fopen(fname, "rbe");
+    int cap = 0;
+    if(!f){
+        perror(fname);
+        return -1;
+    }
+    if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+            memcmp(magic, MTSUITE_BASELINE_MAGIC, sizeof(magic))){
+        printf("%s is not a baseline file.\n", fname);
+        fclose(f);
+        return -1;
+    }
+    for(;;){
+        unsigned short namelen, count;
+        struct BaselineEntry *e;
+        float sample;
+        int i;
+        if(fread(&namelen, sizeof(namelen), 1, f) != 1){ break; }
+        if(run->n_baseline == cap){
+            struct BaselineEntry *grown = realloc(run->baseline,
+                (cap ? cap * 2 : 64) * sizeof(*run->baseline));
+            if(!grown){
+                perror("loading baseline");
+                fclose(f);
+                return -1;
+            }
+            run->baseline = grown;
+            cap = cap ? cap * 2 : 64;
+        }
+        e = &run->baseline[run->n_baseline];
+        if(!(e->name = malloc(namelen + 1)) ||
+                fread(e->name, 1, namelen, f) != namelen ||
+                fread(&count, sizeof(count), 1, f) != 1 ||
+                !(e->samples = malloc((count ? count : 1) * sizeof(double)))){
+            printf("Truncated baseline file %s.\n", fname);
+            fclose(f);
+            return -1;
+        }
+        e->name[namelen] = 0;
+        e->n_samples = count;
+        for(i=0; i < count; ++i){
+            if(fread(&sample, sizeof(sample), 1, f) != 1){
+                printf("Truncated baseline file %s.\n", fname);
+                fclose(f);
+                return -1;
+            }
+            e->samples[i] = sample;
+        }
+        ++run->n_baseline;
+    }
+    fclose(f);
+    qsort(run->baseline, run->n_baseline, sizeof(*run->baseline),
+        _cmp_baseline);
+    return 0;
+}
+
+static void _baseline_save(const char *name, const struct BenchStats *st){
+    Testrunner_t *run = _runner();
+    unsigned short namelen = (unsigned short)strlen(name);
+    unsigned short count = (unsigned short)st->n_samples;
+    int i;
+    fwrite(&namelen, sizeof(namelen), 1, run->baseline_out);
+    fwrite(name, 1, namelen, run->baseline_out);
+    fwrite(&count, sizeof(count), 1, run->baseline_out);
+    for(i=0; i < count; ++i){
+        float sample = (float)st->samples[i];
+        fwrite(&sample, sizeof(sample), 1, run->baseline_out);
+    }
+}
+
+/* Two-sided Mann-Whitney U test of `a` against `b`, using the normal
+ * approximation with tie and continuity corrections.  Returns the p-value
+ * that both come from the same distribution. */
+static double _mann_whitney_p(
+    const double *a, int n_a, const double *b, int n_b
+){
+    struct { double v; int from_a; } *all;
+    double rank_sum = 0, ties = 0, u, mean, var, z;
+    int n = n_a + n_b, i, j, k;
+    if(!n_a || !n_b || !(all = malloc(n * sizeof(*all)))){ return 1; }
+    for(i=0; i < n_a; ++i){ all[i].v = a[i]; all[i].from_a = 1; }
+    for(i=0; i < n_b; ++i){ all[n_a+i].v = b[i]; all[n_a+i].from_a = 0; }
+    /* Insertion sort: sample counts are at most MTSUITE_MAX_BENCH_ROUNDS
+     * plus what the baseline holds. */
+    for(i=1; i < n; ++i){
+        for(j=i; j > 0 && all[j-1].v > all[j].v; --j){
+            double v = all[j].v;
+            int from_a = all[j].from_a;
+            all[j] = all[j-1];
+            all[j-1].v = v;
+            all[j-1].from_a = from_a;
+        }
+    }
+    for(i=0; i < n; i=j){
+        double t;
+        for(j=i+1; j < n && all[j].v == all[i].v; ++j)
+            ;
+        t = j - i;
+        ties += t*t*t - t;
+        /* Ranks are 1-based; tied values share the average rank. */
+        for(k=i; k < j; ++k){
+            if(all[k].from_a){ rank_sum += (i + 1 + j) / 2.0; }
+        }
+    }
+    free(all);
+    u = rank_sum - n_a * (n_a + 1) / 2.0;
+    mean = n_a * (double)n_b / 2;
+    var = n_a * (double)n_b / 12 * ((n + 1) - ties / ((double)n * (n - 1)));
+    if(var <= 0){ return 1; }
+    z = fabs(u - mean) - 0.5;
+    if(z < 0){ z = 0; }
+    z /= sqrt(var);
+    return erfc(z / sqrt(2));
+}
+
+/* Save and/or compare the samples of a finished benchmark. */
+static void _baseline_note(const struct TestResult *res){
+    Testrunner_t *run = _runner();
+    char name[MTSUITE_MAX_NAMELEN];
+    struct BaselineEntry key, *old;
+    double old_sorted[MTSUITE_MAX_BENCH_ROUNDS], old_median, change, p;
+    int n_old;
+    if(!res->tcase->bench || !res->bench.n_samples){ return; }
+    snprintf(name, sizeof(name), "%s%s", res->group->prefix, res->tcase->name);
+    if(res->bench.noisy){
+        /* Neither worth keeping nor worth a verdict. */
+        if((run->baseline_out || run->baseline) && run->opt_verbosity >= 0){
+            printf("  [%s: too noisy to save or compare]\n", name);
+        }
+        return;
+    }
+    if(run->baseline_out){
+        _baseline_save(name, &res->bench);
+    }
+    if(!run->baseline){ return; }
+
+    key.name = name;
+    old = bsearch(&key, run->baseline, run->n_baseline, sizeof(*run->baseline),
+        _cmp_baseline);
+    if(!old || !old->n_samples){
+        printf("  [%s: not in baseline]\n", name);
+        return;
+    }
+    n_old = old->n_samples < MTSUITE_MAX_BENCH_ROUNDS ?
+        old->n_samples : MTSUITE_MAX_BENCH_ROUNDS;
+    memcpy(old_sorted, old->samples, n_old * sizeof(double));
+    old_median = _median(old_sorted, n_old);
+    change = old_median > 0 ? (res->bench.median / old_median - 1) * 100 : 0;
+    p = _mann_whitney_p(res->bench.samples, res->bench.n_samples,
+        old->samples, old->n_samples);
+    if(p >= run->opt_baseline_alpha ||
+            fabs(change) < run->opt_baseline_min_change){
+        if(run->opt_verbosity > 0){
+            printf("  [%s: unchanged, %.2f -> %.2f ns/op (%+.1f%%), p=%.3g]\n",
+                name, old_median, res->bench.median, change, p);
+        }
+    }else if(change > 0){
+        ++run->n_regressed;
+        printf("  [%s: REGRESSED, %.2f -> %.2f ns/op (%+.1f%%), p=%.3g]\n",
+            name, old_median, res->bench.median, change, p);
+    }else if(run->opt_verbosity >= 0){
+        printf("  [%s: improved, %.2f -> %.2f ns/op (%+.1f%%), p=%.3g]\n",
+            name, old_median, res->bench.median, change, p);
+    }
+}
+
+/* Recorded test durations for --durations and --save-durations: one
+ * "SECONDS NAME" line per test.  Files from several shards can simply be
+ * concatenated. */
+struct DurationEntry {
+    char *name;
+    double seconds;
+};
+
+static int _cmp_duration(const void *a, const void *b){
+    return strcmp(((const struct DurationEntry*)a)->name,
+        ((const struct DurationEntry*)b)->name);
+}
+
+static int _durations_load(const char *fname){
+    Testrunner_t *run = _runner();
+    FILE *f = fopen(fname, "re");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int n_cap = 0;
+    if(!f){
+        perror(fname);
+        return -1;
+    }
+    while((len = getline(&line, &cap, f)) != -1){
+        struct DurationEntry *e;
+        char *endp, *name;
+        double seconds = strtod(line, &endp);
+        while(len && (line[len-1] == '\n' || line[len-1] == '\r')){
+            line[--len] = 0;
+        }
+        if(endp == line || *endp != ' ' || !endp[1]){ continue; }
+        name = endp + 1;
+        if(run->n_durations == n_cap){
+            struct DurationEntry *grown = realloc(run->durations,
+                (n_cap ? n_cap * 2 : 256) * sizeof(*run->durations));
+            if(!grown){ break; }
+            run->durations = grown;
+            n_cap = n_cap ? n_cap * 2 : 256;
+        }
+        e = &run->durations[run->n_durations];
+        if(!(e->name = strdup(name))){ break; }
+        e->seconds = seconds;
+        ++run->n_durations;
+    }
+    free(line);
+    fclose(f);
+    if(len != -1){
+        perror("loading durations");
+        return -1;
+    }
+    qsort(run->durations, run->n_durations, sizeof(*run->durations),
+        _cmp_duration);
+    return 0;
+}
+
+/* Recorded duration of `tcase`, or -1 if there is none. */
+static double _duration_of(
+    const Testgroup_t *group, const Testcase_t *tcase
+){
+    Testrunner_t *run = _runner();
+    char name[MTSUITE_MAX_NAMELEN];
+    struct DurationEntry key, *e;
+    if(!run->n_durations){ return -1; }
+    snprintf(name, sizeof(name), "%s%s", group->prefix, tcase->name);
+    key.name = name;
+    e = bsearch(&key, run->durations, run->n_durations,
+        sizeof(*run->durations), _cmp_duration);
+    return e ? e->seconds : -1;
+}
+
+static void _durations_note(const struct TestResult *res){
+    if(_runner()->durations_out){
+        fprintf(_runner()->durations_out, "%.6f %s%s\n", res->t_wall,
+            res->group->prefix, res->tcase->name);
+    }
+}
+
+/* Machine-readable reporters.  Each one writes a record per test as soon as
+ * the test is counted, and the stream is flushed after every record, so a
+ * run that is killed part way, even by a test that hangs, leaves every
+ * record up to that point behind.  A report written to a file of its own
+ * also gets its closing lines after every record, to be written over by
+ * the next one, so that it is a complete document at any time. */
+
+struct Reporter {
+    const char *name;
+    void (*begin)(FILE *);
+    void (*test)(FILE *, const struct TestResult *, int number);
+    void (*end)(FILE *, int n_tests);
+};
+
+static const char *_outcome_name(enum Outcome outcome){
+    switch(outcome){
+    case OK: return "ok";
+    case SKIP: return "skip";
+    case TIMEOUT: return "timeout";
+    default: return "fail";
+    }
+}
+
+/* Walk res->messages: each message is "file\0line\0text\0".  Returns a
+ * pointer past the message, or NULL at the end. */
+static const char *_next_message(
+    const struct TestResult *res, const char *cp,
+    const char **file, const char **line, const char **text
+){
+    if(!cp){ cp = res->messages; }
+    if(!cp || cp >= res->messages + res->messages_len){ return NULL; }
+    *file = cp;
+    *line = *file + strlen(*file) + 1;
+    *text = *line + strlen(*line) + 1;
+    return *text + strlen(*text) + 1;
+}
+
+static void _json_chars(FILE *out, const char *s){
+    for(; *s; ++s){
+        unsigned char c = (unsigned char)*s;
+        if(c == '"' || c == '\\'){
+            putc('\\', out);
+            putc(c, out);
+        }else if(c == '\n'){
+            fputs("\\n", out);
+        }else if(c < 0x20){
+            fprintf(out, "\\u%04x", c);
+        }else{
+            putc(c, out);
+        }
+    }
+}
+
+static void _jsonl_test(FILE *out, const struct TestResult *res, int number){
+    const char *cp = NULL, *file, *line, *text;
+    int first = 1;
+    (void)number;
+    fputs("{\"name\":\"", out);
+    _json_chars(out, res->group->prefix);
+    _json_chars(out, res->tcase->name);
+    fprintf(out, "\",\"outcome\":\"%s\",\"duration\":%.9f,"
+        "\"setup\":%.9f,\"callback\":%.9f,\"cleanup\":%.9f,"
+        "\"utime\":%.6f,\"stime\":%.6f,\"maxrss\":%ld",
+        _outcome_name(res->outcome), res->t_wall, res->t_setup,
+        res->t_callback, res->t_cleanup, res->utime, res->stime, res->maxrss);
+    if(res->tcase->bench && res->bench.n_samples){
+        fprintf(out, ",\"iters\":%lu,\"ns_per_op\":%.3f,\"median\":%.3f,"
+            "\"min\":%.3f,\"mad\":%.3f,\"cv\":%.3f,\"noisy\":%s",
+            res->bench.iters, res->bench.mean, res->bench.median,
+            res->bench.min, res->bench.mad, res->bench.cv,
+            res->bench.noisy ? "true" : "false");
+    }
+    if(_runner()->opt_heap){
+        fprintf(out, ",\"allocs\":%ld,\"alloc_bytes\":%ld,\"peak_bytes\":%ld,"
+            "\"leaked_bytes\":%ld", res->heap.allocs, res->heap.bytes,
+            res->heap.peak, res->heap.leaked);
+    }
+#ifdef __linux__
+    if(_runner()->opt_counters && res->counters.present){
+        const struct CounterStats *cs = &res->counters;
+        const char *sep = ",\"counters\":{";
+        int i;
+        for(i=0; i < MTSUITE_N_COUNTERS; ++i){
+            if(cs->present & (1u << i)){
+                fprintf(out, "%s\"%s\":%.0f", sep, counter_descs[i].name,
+                    cs->value[i]);
+                sep = ",";
+            }
+        }
+        if(cs->ops){ fprintf(out, ",\"ops\":%.0f", cs->ops); }
+        fputs("}", out);
+    }
+#endif
+    fputs(",\"failures\":[", out);
+    while((cp = _next_message(res, cp, &file, &line, &text))){
+        fputs(first ? "{\"file\":\"" : ",{\"file\":\"", out);
+        _json_chars(out, file);
+        fprintf(out, "\",\"line\":%s,\"message\":\"", line);
+        _json_chars(out, text);
+        fputs("\"}", out);
+        first = 0;
+    }
+    fputs("]}\n", out);
+}
+
+static void _tap_begin(FILE *out){
+    fputs("TAP version 13\n", out);
+}
+
+static void _tap_test(FILE *out, const struct TestResult *res, int number){
+    const char *cp = NULL, *file, *line, *text;
+    fprintf(out, "%s %d - %s%s", res->outcome == FAIL ||
+        res->outcome == TIMEOUT ? "not ok" : "ok", number,
+        res->group->prefix, res->tcase->name);
+    if(res->outcome == SKIP){
+        fputs(" # SKIP", out);
+    }else if(res->outcome == TIMEOUT){
+        fputs(" # timed out", out);
+    }
+    fprintf(out, "\n  ---\n  duration_ms: %.3f\n", res->t_wall * 1e3);
+    while((cp = _next_message(res, cp, &file, &line, &text))){
+        /* Block scalars keep arbitrary message text valid YAML. */
+        fprintf(out, "  at: %s:%s\n  message: |-\n    ", file, line);
+        for(; *text; ++text){
+            putc(*text, out);
+            if(*text == '\n'){ fputs("    ", out); }
+        }
+        putc('\n', out);
+    }
+    fputs("  ...\n", out);
+}
+
+static void _tap_end(FILE *out, int n_tests){
+    fprintf(out, "1..%d\n", n_tests);
+}
+
+static void _xml_chars(FILE *out, const char *s, size_t len){
+    size_t i;
+    for(i=0; i < len && s[i]; ++i){
+        unsigned char c = (unsigned char)s[i];
+        switch(c){
+        case '<': fputs("&lt;", out); break;
+        case '>': fputs("&gt;", out); break;
+        case '&': fputs("&amp;", out); break;
+        case '"': fputs("&quot;", out); break;
+        default:
+            if(c == '\r'){
+                fputs("&#13;", out);
+            }else if(c < 0x20 && c != '\n' && c != '\t'){
+                /* Not representable in XML 1.0 at all. */
+                fputs("&#xFFFD;", out);
+            }else{
+                putc(c, out);
+            }
+        }
+    }
+}
+
+static void _junit_begin(FILE *out){
+    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<testsuites>\n<testsuite name=\"mtsuite\">\n", out);
+}
+
+static void _junit_test(FILE *out, const struct TestResult *res, int number){
+    const char *cp = NULL, *file, *line, *text;
+    const char *prefix = res->group->prefix;
+    size_t classlen = strlen(prefix);
+    (void)number;
+    /* "demo/" becomes classname "demo". */
+    if(classlen && prefix[classlen-1] == '/'){ --classlen; }
+    fputs("  <testcase classname=\"", out);
+    _xml_chars(out, prefix, classlen);
+    fputs("\" name=\"", out);
+    _xml_chars(out, res->tcase->name, (size_t)-1);
+    fprintf(out, "\" time=\"%.6f\"", res->t_wall);
+    if(res->outcome == OK){
+        fputs("/>\n", out);
+        return;
+    }
+    fputs(">\n", out);
+    if(res->outcome == SKIP){
+        fputs("    <skipped/>\n", out);
+    }else{
+        fprintf(out, "    <failure type=\"%s\" message=\"%s\">",
+            _outcome_name(res->outcome),
+            res->outcome == TIMEOUT ? "timed out" : "failed");
+        while((cp = _next_message(res, cp, &file, &line, &text))){
+            _xml_chars(out, file, (size_t)-1);
+            fprintf(out, ":%s: ", line);
+            _xml_chars(out, text, (size_t)-1);
+            putc('\n', out);
+        }
+        fputs("</failure>\n", out);
+    }
+    fputs("  </testcase>\n", out);
+}
+
+static void _junit_end(FILE *out, int n_tests){
+    (void)n_tests;
+    fputs("</testsuite>\n</testsuites>\n", out);
+}
+
+static const struct Reporter reporters[] = {
+    { "jsonl", NULL, _jsonl_test, NULL },
+    { "tap", _tap_begin, _tap_test, _tap_end },
+    { "junit", _junit_begin, _junit_test, _junit_end },
+    { NULL, NULL, NULL, NULL }
+};
+
+static int _reporter_select(const char *name){
+    int i;
+    for(i=0; reporters[i].name; ++i){
+        if(!strcmp(reporters[i].name, name)){
+            _runner()->reporter = &reporters[i];
+            return 0;
+        }
+    }
+    printf("Unknown format %s. Try --help\n", name);
+    return -1;
+}
+
+/* Open the report stream.  With no --output the report goes to stdout and,
+ * under mtsuite_main, the usual human-readable output is moved to stderr;
+ * an embedded runner leaves the process's descriptors alone. */
+static int _reporter_open(const char *fname){
+    Testrunner_t *run = _runner();
+    const size_t buflen = 1 << 16;
+    if(fname && strcmp(fname, "-")){
+        if((run->report_out = fopen(fname, "we"))){
+            run->report_rewind =
+                lseek(fileno(run->report_out), 0, SEEK_CUR) != -1;
+        }
+    }else{
+        int fd;
+        fflush(stdout);
+        if((fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0)) != -1){
+            if(run->owns_process){ dup2(STDERR_FILENO, STDOUT_FILENO); }
+            if(!(run->report_out = fdopen(fd, "w"))){ close(fd); }
+        }
+    }
+    if(!run->report_out){
+        perror(fname ? fname : "stdout");
+        return -1;
+    }
+    if((run->report_buf = malloc(buflen))){
+        setvbuf(run->report_out, run->report_buf, _IOFBF, buflen);
+    }
+    if(run->reporter->begin){ run->reporter->begin(run->report_out); }
+    fflush(run->report_out);
+    return 0;
+}
+
+static void _reporter_note(const struct TestResult *res){
+    Testrunner_t *run = _runner();
+    long pos;
+    if(!run->report_out){ return; }
+    run->reporter->test(run->report_out, res, ++run->n_reported);
+    if(run->reporter->end && run->report_rewind &&
+            (pos = ftell(run->report_out)) != -1){
+        /* The next record, or the real end, starts where this one ends;
+         * either is at least as long as these closing lines. */
+        run->reporter->end(run->report_out, run->n_reported);
+        fflush(run->report_out);
+        fseek(run->report_out, pos, SEEK_SET);
+    }else{
+        fflush(run->report_out);
+    }
+}
+
+static void _reporter_close(void){
+    Testrunner_t *run = _runner();
+    if(!run->report_out){ return; }
+    if(run->reporter->end){
+        run->reporter->end(run->report_out, run->n_reported);
+    }
+    if(fclose(run->report_out)){ perror("writing report"); }
+    run->report_out = NULL;
+    free(run->report_buf);
+    run->report_buf = NULL;
+}
+
+/* Write every recorded span to trace_fname as Chrome trace-event JSON, with
+ * times in microseconds since the run started. */
+static void _trace_write(void){
+    Testrunner_t *run = _runner();
+    static const char *const kinds[] = { "test", "phase", "user", "runner" };
+    char name[MTSUITE_MAX_NAMELEN];
+    struct TraceRecord rec;
+    const char *buf = run->main_state.trace;
+    size_t off = 0, len = run->main_state.trace_len;
+    int max_track = 0, i;
+    FILE *out;
+    if(!run->trace_fname){ return; }
+    if(!(out = fopen(run->trace_fname, "we"))){
+        perror(run->trace_fname);
+        return;
+    }
+    fputs("{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\","
+        "\"pid\":1,\"args\":{\"name\":\"mtsuite\"}}", out);
+    while(len - off >= sizeof(rec)){
+        memcpy(&rec, buf + off, sizeof(rec));
+        memcpy(name, buf + off + sizeof(rec), rec.name_len);
+        name[rec.name_len] = 0;
+        off += sizeof(rec) + rec.name_len;
+        fputs(",\n{\"name\":\"", out);
+        _json_chars(out, name);
+        fprintf(out, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":1,\"tid\":%d}", kinds[rec.kind & 3],
+            (rec.ts - run->trace_t0) * 1e6, rec.dur * 1e6, rec.track);
+        if(rec.track > max_track){ max_track = rec.track; }
+    }
+    for(i=0; i <= max_track; ++i){
+        if(!i){
+            snprintf(name, sizeof(name), "main");
+        }else if(i <= run->opt_threads){
+            snprintf(name, sizeof(name), "thread %d", i);
+        }else if(i > run->opt_threads + run->opt_jobs){
+            snprintf(name, sizeof(name), "async %d", i - run->opt_threads -
+                run->opt_jobs);
+        }else{
+            snprintf(name, sizeof(name), "%s %d", run->opt_isolation ==
+                ISOLATE_POOL ? "worker" : "job", i - run->opt_threads);
+        }
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", i, name);
+    }
+    fputs("\n]}\n", out);
+    if(fclose(out)){ perror("writing trace"); }
+    run->main_state.trace_len = 0;
+}
+
+/* Result cache: every test's last outcome and wall time, so that the next
+ * run can put previous failures first (--failed-first) or run only those
+ * (--rerun-failed).  The file is the magic "MTSC1\n" followed by records,
+ * in native byte order:
+ *     uint16 name length, name (prefix + name, no NUL),
+ *     uint8 outcome, float seconds
+ * A run compacts the file to one record per test when it starts (into a
+ * fresh temporary file that then takes its name), then appends a record
+ * for each test as it is counted, each with a single write(), so that a
+ * run that is killed loses nothing.  On loading, the last record for a
+ * name wins.  Only --cache=FILE keeps a cache on every run; without it,
+ * mtsuite_main keeps one per program, named after it, for the runs that
+ * read it. */
+#define MTSUITE_CACHE_MAGIC "MTSC1\n"
+#define MTSUITE_CACHE_FILE ".mtsuite-cache-"
+/* The longest record: length, name, outcome, seconds. */
+#define MTSUITE_CACHE_RECLEN (2 + MTSUITE_MAX_NAMELEN + 1 + sizeof(float))
+
+struct CacheEntry {
+    char *name;
+    int seq;            /* position in the file; later records win */
+    unsigned char outcome;
+    float seconds;
+};
+
+static int _cmp_name_only(const void *a, const void *b){
+    return strcmp(((const struct CacheEntry*)a)->name,
+        ((const struct CacheEntry*)b)->name);
+}
+
+static int _cmp_cache(const void *a, const void *b){
+    const struct CacheEntry *x = a, *y = b;
+    int r = strcmp(x->name, y->name);
+    return r ? r : x->seq - y->seq;
+}
+
+/* Put one record in `buf` (MTSUITE_CACHE_RECLEN long); returns its size. */
+static size_t _cache_record(
+    char *buf, const char *name, unsigned char outcome, float seconds
+){
+    size_t len = strlen(name);
+    unsigned short namelen;
+    if(len > MTSUITE_MAX_NAMELEN){ len = MTSUITE_MAX_NAMELEN; }
+    namelen = (unsigned short)len;
+    memcpy(buf, &namelen, sizeof(namelen));
+    memcpy(buf + 2, name, len);
+    buf[2 + len] = (char)outcome;
+    memcpy(buf + 3 + len, &seconds, sizeof(seconds));
+    return 3 + len + sizeof(seconds);
+}
+
+/* Read what is left of an earlier run's cache; a missing or unreadable
+ * file just means starting afresh.  Returns -1 if memory runs out. */
+static int _cache_load(void){
+    Testrunner_t *run = _runner();
+    char magic[sizeof(MTSUITE_CACHE_MAGIC) - 1];
+    FILE *f = fopen(run->cache_fname, "rbe");
+    int cap = 0, i, n;
+    if(!f){ return 0; }
+    if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+            memcmp(magic, MTSUITE_CACHE_MAGIC, sizeof(magic))){
+        fclose(f);
+        return 0;
+    }
+    for(;;){
+        unsigned short namelen;
+        struct CacheEntry *e;
+        if(fread(&namelen, sizeof(namelen), 1, f) != 1){ break; }
+        if(run->n_cache == cap){
+            struct CacheEntry *grown = realloc(run->cache,
+                (cap ? cap * 2 : 256) * sizeof(*run->cache));
+            if(!grown){
+                perror("loading result cache");
+                fclose(f);
+                return -1;
+            }
+            run->cache = grown;
+            cap = cap ? cap * 2 : 256;
+        }
+        e = &run->cache[run->n_cache];
+        if(!(e->name = malloc(namelen + 1))){
+            perror("loading result cache");
+            fclose(f);
+            return -1;
+        }
+        if(fread(e->name, 1, namelen, f) != namelen ||
+                fread(&e->outcome, 1, 1, f) != 1 ||
+                fread(&e->seconds, sizeof(e->seconds), 1, f) != 1){
+            /* A run cut short mid-record; keep what came before. */
+            free(e->name);
+            break;
+        }
+        e->name[namelen] = 0;
+        e->seq = run->n_cache++;
+    }
+    fclose(f);
+    qsort(run->cache, run->n_cache, sizeof(*run->cache), _cmp_cache);
+    for(i=0, n=0; i < run->n_cache; ++i){
+        if(i + 1 < run->n_cache &&
+                !strcmp(run->cache[i].name, run->cache[i+1].name)){
+            free(run->cache[i].name);
+            continue;
+        }
+        run->cache[n++] = run->cache[i];
+    }
+    run->n_cache = n;
+    return 0;
+}
+
+/* Rewrite the cache compacted, then keep it open to append to.  The
+ * temporary file has a name of its own, so two runs sharing a cache do not
+ * write over each other's; whichever renames last wins. */
+static void _cache_open(void){
+    Testrunner_t *run = _runner();
+    size_t len = strlen(run->cache_fname), used = 0;
+    const size_t buflen = 1 << 16;
+    char *tmp = malloc(len + 8), *buf = malloc(buflen);
+    int fd = -1, failed = 0, i;
+    if(!tmp || !buf){
+        perror("writing result cache");
+        free(tmp);
+        free(buf);
+        return;
+    }
+    memcpy(tmp, run->cache_fname, len);
+    memcpy(tmp + len, ".XXXXXX", 8);
+    if((fd = mkostemp(tmp, O_CLOEXEC | O_APPEND)) == -1){
+        perror(tmp);
+        free(tmp);
+        free(buf);
+        return;
+    }
+    memcpy(buf, MTSUITE_CACHE_MAGIC, sizeof(MTSUITE_CACHE_MAGIC) - 1);
+    used = sizeof(MTSUITE_CACHE_MAGIC) - 1;
+    for(i=0; i < run->n_cache && !failed; ++i){
+        if(buflen - used < MTSUITE_CACHE_RECLEN){
+            failed = _write_all(fd, buf, used);
+            used = 0;
+        }
+        used += _cache_record(buf + used, run->cache[i].name,
+            run->cache[i].outcome, run->cache[i].seconds);
+    }
+    if(failed || _write_all(fd, buf, used) ||
+            rename(tmp, run->cache_fname)){
+        perror("writing result cache");
+        close(fd);
+        unlink(tmp);
+    }else{
+        run->cache_fd = fd;
+    }
+    free(tmp);
+    free(buf);
+}
+
+static void _cache_note(const struct TestResult *res){
+    Testrunner_t *run = _runner();
+    char name[MTSUITE_MAX_NAMELEN], rec[MTSUITE_CACHE_RECLEN];
+    size_t len;
+    if(run->cache_fd == -1){ return; }
+    snprintf(name, sizeof(name), "%s%s", res->group->prefix, res->tcase->name);
+    len = _cache_record(rec, name, (unsigned char)res->outcome,
+        (float)res->t_wall);
+    if(_write_all(run->cache_fd, rec, len)){
+        perror("writing result cache");
+        close(run->cache_fd);
+        run->cache_fd = -1;
+    }
+}
+
+static void _cache_close(void){
+    Testrunner_t *run = _runner();
+    int i;
+    if(run->cache_fd != -1){ close(run->cache_fd); }
+    run->cache_fd = -1;
+    for(i=0; i < run->n_cache; ++i){ free(run->cache[i].name); }
+    free(run->cache);
+    run->cache = NULL;
+    run->n_cache = 0;
+}
+
+/* Did `tcase` fail or time out the last time it ran? */
+static int _cache_failed(const Testgroup_t *group, const Testcase_t *tcase){
+    Testrunner_t *run = _runner();
+    char name[MTSUITE_MAX_NAMELEN];
+    struct CacheEntry key, *e;
+    if(!run->n_cache){ return 0; }
+    snprintf(name, sizeof(name), "%s%s", group->prefix, tcase->name);
+    key.name = name;
+    key.seq = 0;
+    e = bsearch(&key, run->cache, run->n_cache, sizeof(*run->cache),
+        _cmp_name_only);
+    return e && (e->outcome == FAIL || e->outcome == TIMEOUT);
+}
+
+/* Seconds `tcase` took last time, from the result cache, or -1. */
+static double _cache_seconds(
+    const Testgroup_t *group, const Testcase_t *tcase
+){
+    Testrunner_t *run = _runner();
+    char name[MTSUITE_MAX_NAMELEN];
+    struct CacheEntry key, *e;
+    if(!run->n_cache){ return -1; }
+    snprintf(name, sizeof(name), "%s%s", group->prefix, tcase->name);
+    key.name = name;
+    key.seq = 0;
+    e = bsearch(&key, run->cache, run->n_cache, sizeof(*run->cache),
+        _cmp_name_only);
+    return e ? e->seconds : -1;
+}
+
+/* Live status for --status-file and --status-socket.  The runners note in
+ * a slot per trace track which test each of them is running, and
+ * _count_outcome notes every end; that is all the hot path pays, a
+ * mutex taken twice per test.  A thread of its own turns this into a JSON
+ * snapshot every --status-interval seconds for the file, written aside and
+ * renamed into place, and on demand for each client of the socket.  It
+ * only uses the runner's allocator, so --heap never sees it.  The ETA
+ * scales the time taken so far by the recorded durations (--durations,
+ * else the result cache) of the tests still to finish against those of
+ * the ones done. */
+struct StatusSlot {
+    const Testgroup_t *group;
+    const Testcase_t *tcase;    /* NULL when idle */
+    double started;
+};
+
+static double _status_expected(
+    const Testgroup_t *group, const Testcase_t *tcase
+){
+    double t = _duration_of(group, tcase);
+    if(t < 0){ t = _cache_seconds(group, tcase); }
+    return t < 0 ? _runner()->status_fallback : t;
+}
+
+static void _status_running(
+    int track, const Testgroup_t *group, const Testcase_t *tcase
+){
+    Testrunner_t *run = _runner();
+    if(!run->status_slots || track < 0 || track >= run->n_status_slots){
+        return;
+    }
+    pthread_mutex_lock(&run->status_lock);
+    run->status_slots[track].group = group;
+    run->status_slots[track].tcase = tcase;
+    run->status_slots[track].started = _monotonic_now();
+    pthread_mutex_unlock(&run->status_lock);
+}
+
+static void _status_done(const struct TestResult *res){
+    Testrunner_t *run = _runner();
+    double expected;
+    if(!run->status_slots){ return; }
+    expected = _status_expected(res->group, res->tcase);
+    pthread_mutex_lock(&run->status_lock);
+    if(res->track >= 0 && res->track < run->n_status_slots &&
+            run->status_slots[res->track].tcase == res->tcase){
+        run->status_slots[res->track].tcase = NULL;
+    }
+    ++run->status_done;
+    switch(res->outcome){
+    case OK: ++run->status_ok; break;
+    case SKIP: ++run->status_skipped; break;
+    case TIMEOUT: ++run->status_timed_out; break;
+    default: ++run->status_failed; break;
+    }
+    run->status_work_done += expected;
+    pthread_mutex_unlock(&run->status_lock);
+}
+
+static void _status_put(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void _status_put(const char *fmt, ...){
+    Testrunner_t *run = _runner();
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if(n < 0){ return; }
+    if(run->status_len + n + 1 > run->status_cap){
+        size_t cap = run->status_cap ? run->status_cap : 4096;
+        char *buf;
+        while(cap < run->status_len + n + 1){ cap *= 2; }
+        if(!(buf = runner_realloc(run->status_buf, cap))){ return; }
+        run->status_buf = buf;
+        run->status_cap = cap;
+    }
+    va_start(ap, fmt);
+    vsnprintf(run->status_buf + run->status_len, n + 1, fmt, ap);
+    va_end(ap);
+    run->status_len += n;
+}
+
+static void _status_put_json(const char *s){
+    for(; *s; ++s){
+        unsigned char c = (unsigned char)*s;
+        if(c == '"' || c == '\\'){
+            _status_put("\\%c", c);
+        }else if(c < 0x20){
+            _status_put("\\u%04x", c);
+        }else{
+            _status_put("%c", c);
+        }
+    }
+}
+
+/* Render the current status into status_buf. */
+static void _status_snapshot(const char *state){
+    Testrunner_t *run = _runner();
+    double now = _monotonic_now(), elapsed = now - run->status_began;
+    int i, first = 1;
+    run->status_len = 0;
+    pthread_mutex_lock(&run->status_lock);
+    _status_put("{\"state\":\"%s\",\"elapsed\":%.3f,\"total\":%d,"
+        "\"done\":%d,\"ok\":%d,\"failed\":%d,\"timed_out\":%d,"
+        "\"skipped\":%d,\"tests_per_sec\":%.3f,\"eta\":", state, elapsed,
+        run->status_total, run->status_done, run->status_ok,
+        run->status_failed, run->status_timed_out, run->status_skipped,
+        elapsed > 0 ? run->status_done / elapsed : 0);
+    if(run->status_work_done > 0){
+        double left = run->status_work - run->status_work_done;
+        _status_put("%.3f",
+            left > 0 ? elapsed * left / run->status_work_done : 0);
+    }else{
+        _status_put("null");
+    }
+    _status_put(",\"running\":[");
+    for(i=0; i < run->n_status_slots; ++i){
+        const struct StatusSlot *slot = &run->status_slots[i];
+        if(!slot->tcase){ continue; }
+        _status_put("%s{\"name\":\"", first ? "" : ",");
+        _status_put_json(slot->group->prefix);
+        _status_put_json(slot->tcase->name);
+        _status_put("\",\"elapsed\":%.3f,\"track\":%d}", now - slot->started,
+            i);
+        first = 0;
+    }
+    pthread_mutex_unlock(&run->status_lock);
+    _status_put("]}\n");
+}
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  /* SO_NOSIGPIPE is set on the client instead */
+#endif
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 0  /* FD_CLOEXEC is set once it is open instead */
+#endif
+
+/* A client of the status socket, close-on-exec and never raising SIGPIPE,
+ * or -1. */
+static int _status_accept(int sock){
+#ifdef __linux__
+    return accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+#else
+    int fd = accept(sock, NULL, NULL);
+    if(fd != -1){
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int));
+#endif
+    }
+    return fd;
+#endif
+}
+
+static int _status_send(int fd){
+    Testrunner_t *run = _runner();
+    size_t off = 0;
+    while(off < run->status_len){
+        ssize_t n = send(fd, run->status_buf + off, run->status_len - off,
+            MSG_NOSIGNAL);
+        if(n == -1){
+            if(errno == EINTR){ continue; }
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+/* Write status_buf to status_fname, replacing it whole. */
+static void _status_write_file(void){
+    Testrunner_t *run = _runner();
+    char tmp[PATH_MAX];
+    size_t off = 0;
+    int fd;
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", run->status_fname) >=
+            (int)sizeof(tmp)){
+        return;
+    }
+    if((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) == -1){
+        return;
+    }
+    while(off < run->status_len){
+        ssize_t n = write(fd, run->status_buf + off, run->status_len - off);
+        if(n == -1 && errno == EINTR){ continue; }
+        if(n <= 0){ break; }
+        off += n;
+    }
+    if(close(fd) || off < run->status_len || rename(tmp, run->status_fname)){
+        unlink(tmp);
+    }
+}
+
+static void *_status_main(void *arg){
+    Testrunner_t *run = cur_runner = arg;
+    double next_write = 0;
+    for(;;){
+        struct pollfd pfds[2];
+        double now = _monotonic_now();
+        int n_fds = 0, timeout_ms = -1;
+        if(run->status_fname){
+            if(now >= next_write){
+                _status_snapshot("running");
+                _status_write_file();
+                next_write = now + run->opt_status_interval;
+            }
+            timeout_ms = _poll_timeout(next_write - now);
+        }
+        pfds[n_fds].fd = run->status_wake[0];
+        pfds[n_fds++].events = POLLIN;
+        if(run->status_sock != -1){
+            pfds[n_fds].fd = run->status_sock;
+            pfds[n_fds++].events = POLLIN;
+        }
+        if(poll(pfds, n_fds, timeout_ms) == -1 && errno != EINTR){ break; }
+        if(pfds[0].revents){ break; }
+        if(n_fds > 1 && pfds[1].revents){
+            int fd = _status_accept(run->status_sock);
+            if(fd != -1){
+                _status_snapshot("running");
+                _status_send(fd);
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Stop the status thread and leave a final snapshot in the file. */
+static void _status_close(void){
+    Testrunner_t *run = _runner();
+    if(!run->status_slots){ return; }
+    if(run->status_wake[1] != -1){
+        char b = 0;
+        while(write(run->status_wake[1], &b, 1) == -1 && errno == EINTR)
+            ;
+        pthread_join(run->status_thread, NULL);
+        close(run->status_wake[0]);
+        close(run->status_wake[1]);
+        run->status_wake[0] = run->status_wake[1] = -1;
+    }
+    if(run->status_fname){
+        _status_snapshot("finished");
+        _status_write_file();
+    }
+    if(run->status_sock != -1){
+        close(run->status_sock);
+        run->status_sock = -1;
+        unlink(run->status_sockname);
+    }
+    free(run->status_slots);
+    run->status_slots = NULL;
+    run->n_status_slots = 0;
+    runner_free(run->status_buf);
+    run->status_buf = NULL;
+    run->status_len = run->status_cap = 0;
+}
+
+/* Keep the outcome of `res` for mtsuite_runner_results(), its failure
+ * messages as "file:line: text" lines. */
+static void _results_note(const struct TestResult *res){
+    Testrunner_t *run = _runner();
+    struct TestrunResult_t *out;
+    const char *cp = NULL, *file, *line, *text;
+    char *messages = NULL;
+    size_t len = 0;
+    if(run->n_results == run->cap_results){
+        int cap = run->cap_results ? run->cap_results * 2 : 64;
+        if(!(out = realloc(run->results, cap * sizeof(*out)))){ return; }
+        run->results = out;
+        run->cap_results = cap;
+    }
+    while((cp = _next_message(res, cp, &file, &line, &text))){
+        size_t more = strlen(file) + strlen(line) + strlen(text) + 5;
+        char *grown = realloc(messages, len + more);
+        if(!grown){ break; }
+        messages = grown;
+        len += *file ?
+            (size_t)sprintf(messages + len, "%s:%s: %s\n", file, line, text) :
+            (size_t)sprintf(messages + len, "%s\n", text);
+    }
+    out = &run->results[run->n_results++];
+    out->prefix = res->group->prefix;
+    out->name = res->tcase->name;
+    out->outcome = res->outcome;
+    out->seconds = res->t_wall;
+    out->messages = messages;
+}
+
+static void _count_outcome(const struct TestResult *res){
+    Testrunner_t *run = _runner();
+    const Testgroup_t *group = res->group;
+    const Testcase_t *tcase = res->tcase;
+    double t0 = run->opt_trace ? _monotonic_now() : 0;
+    _note_slowest(res);
+    _results_note(res);
+    _reporter_note(res);
+    _durations_note(res);
+    _cache_note(res);
+    _status_done(res);
+    _capture_show(res);
+    if(res->outcome == OK){
+        ++run->n_ok;
+        if(run->opt_verbosity > 0){
+            if(tcase->bench && res->bench.n_samples){
+                printf(run->opt_verbosity == 1 ? "OK " : "\n    ");
+                _print_bench(res);
+            }else{
+                printf("%s", run->opt_verbosity == 1 ? "OK" : "");
+                if(run->opt_show_times){
+                    printf(" (%.3f ms)", res->t_wall * 1e3);
+                }
+            }
+            if(run->opt_heap){ _print_heap(res); }
+            if(run->opt_counters){ _print_counters(res); }
+            puts("");
+        }
+        _baseline_note(res);
+    }else if(res->outcome==SKIP){
+        ++run->n_skipped;
+        if(run->opt_verbosity > 0){
+            puts("SKIPPED");
+        }
+    }else if(res->outcome==TIMEOUT){
+        ++run->n_bad;
+        ++run->n_timeout;
+        printf("\n  [%s%s TIMED OUT]\n", group->prefix, tcase->name);
+    }else{
+        ++run->n_bad;
+        if(run->opt_verbosity >= 0){
+            printf("\n  [%s%s FAILED]", group->prefix, tcase->name);
+            if(run->opt_heap){ _print_heap(res); }
+            puts("");
+        }else{
+            puts("");   /* end the failure detail */
+        }
+    }
+    _fixture_release(group);
+    if(run->opt_trace && res->t_begin){
+        char name[MTSUITE_MAX_NAMELEN];
+        int len = snprintf(name, sizeof(name), "%s%s", group->prefix,
+            tcase->name);
+        if(len >= (int)sizeof(name)){ len = sizeof(name) - 1; }
+        _trace_add(_state(), TRACE_TEST, name, len, res->t_begin,
+            res->t_wall, res->track);
+        _trace_span(TRACE_RUNNER, "report", t0, _monotonic_now());
+    }
+}
+
+static void _print_slowest(void){
+    Testrunner_t *run = _runner();
+    int i;
+    if(!run->n_slowest || run->opt_verbosity < 0){ return; }
+    printf("Slowest %d tests:\n", run->n_slowest);
+    printf("  %10s %10s %10s %10s %8s %8s %9s %7s  %s\n",
+        "wall(ms)", "setup", "callback", "cleanup", "user(s)", "sys(s)",
+        "rss(KiB)", "csw", "test");
+    for(i=0; i < run->n_slowest; ++i){
+        const struct TestResult *res = &run->slowest[i];
+        printf("  %10.3f %10.3f %10.3f %10.3f %8.3f %8.3f %9ld %7ld  %s%s\n",
+            res->t_wall * 1e3, res->t_setup * 1e3, res->t_callback * 1e3,
+            res->t_cleanup * 1e3, res->utime, res->stime, res->maxrss,
+            res->nvcsw + res->nivcsw, res->group->prefix, res->tcase->name);
+    }
+}
+
+// ---
+int mtsuite_run_one(
+    const struct Testgroup_t *group, const struct Testcase_t *tcase
+){
+    Testrunner_t *run = _runner();
+    struct TestResult res;
+    double t0;
+    memset(&res, 0, sizeof(res));
+    res.group = group;
+    res.tcase = tcase;
+    if(tcase->flags & (MTSUITE_SKIP|MTSUITE_OFF_BY_DEFAULT)){
+        if(run->opt_verbosity > 0){
+            printf(
+                "%s%s: %s\n",
+                group->prefix, tcase->name,
+                (tcase->flags & MTSUITE_SKIP) ? "SKIPPED" : "DISABLED"
+            );
+        }
+        ++run->n_skipped;
+        res.outcome = SKIP;
+        _results_note(&res);
+        _reporter_note(&res);
+        _status_done(&res);
+        return SKIP;
+    }
+
+    if(run->opt_verbosity > 0){
+        printf("%s%s: ", group->prefix, tcase->name);
+    }else if(run->opt_verbosity == 0){
+        printf(".");
+    }
+    _state_enter(group, tcase);
+    _status_running(_state()->trace_track, group, tcase);
+    t0 = _monotonic_now();
+    /* A hung test can only be reclaimed from outside, so anything with a
+     * deadline runs in a child. */
+    if(_testcase_forks(tcase) || _testcase_timeout(tcase)){
+        if(run->opt_verbosity > 0 && (tcase->flags & MTSUITE_FORK)){
+            printf("[forking] ");
+        }
+        _testcase_run_forked(group, tcase, &res);
+    }else{
+        _capture_begin();
+        _testcase_run_inproc(tcase, &res);
+        _capture_end(&res);
+        res.t_wall = _monotonic_now() - t0;
+        res.t_begin = t0;
+        res.track = _state()->trace_track;
+    }
+    _count_outcome(&res);
+
+    return (int)res.outcome;
+}
+
+/* Every test's full name (prefix + name), sorted, so that selecting by name
+ * or prefix is a binary search instead of a scan over all groups.  Built
+ * once per groups array; the names live in one block. */
+struct IndexEntry {
+    const char *name;
+    Testgroup_t *group;
+    Testcase_t *tcase;
+};
+
+static int _cmp_index(const void *a, const void *b){
+    return strcmp(((const struct IndexEntry*)a)->name,
+        ((const struct IndexEntry*)b)->name);
+}
+
+static void _index_free(void){
+    Testrunner_t *run = _runner();
+    free(run->index_tab);
+    free(run->index_names);
+    run->index_tab = NULL;
+    run->index_names = NULL;
+    run->index_groups = NULL;
+    run->n_index = 0;
+}
+
+static int _index_build(Testgroup_t *groups){
+    Testrunner_t *run = _runner();
+    size_t names_len = 0;
+    char *cp;
+    int i, j, n = 0;
+    if(run->index_groups == groups){ return 0; }
+    _index_free();
+    for(i=0; groups[i].prefix; ++i){
+        for(j=0; _has_case(&groups[i], j); ++j){
+            names_len += strlen(groups[i].prefix)
+                + strlen(groups[i].cases[j].name) + 1;
+            ++n;
+        }
+    }
+    run->index_tab = malloc((n ? n : 1) * sizeof(*run->index_tab));
+    run->index_names = malloc(names_len ? names_len : 1);
+    if(!run->index_tab || !run->index_names){
+        perror("building test index");
+        _index_free();
+        return -1;
+    }
+    cp = run->index_names;
+    for(i=0; groups[i].prefix; ++i){
+        size_t plen = strlen(groups[i].prefix);
+        for(j=0; _has_case(&groups[i], j); ++j){
+            size_t nlen = strlen(groups[i].cases[j].name) + 1;
+            struct IndexEntry *e = &run->index_tab[run->n_index++];
+            e->name = cp;
+            e->group = &groups[i];
+            e->tcase = &groups[i].cases[j];
+            memcpy(cp, groups[i].prefix, plen);
+            memcpy(cp + plen, groups[i].cases[j].name, nlen);
+            cp += plen + nlen;
+        }
+    }
+    qsort(run->index_tab, run->n_index, sizeof(*run->index_tab), _cmp_index);
+    run->index_groups = groups;
+    return 0;
+}
+
+/* First index entry whose name is not below the first `len` bytes of
+ * `key`; entries matching those bytes follow it contiguously. */
+static int _index_lower_bound(const char *key, size_t len){
+    int lo = 0, hi = _runner()->n_index;
+    while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if(strncmp(_runner()->index_tab[mid].name, key, len) < 0){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// ---
+int mtsuite_set_flag(
+    struct Testgroup_t *groups, const char *arg, int set, unsigned long flag
+){
+    Testrunner_t *run = _runner();
+    int i, j;
+    size_t len = MTSUITE_MAX_NAMELEN;
+    int found = 0;
+    if(strstr(arg, "..")){
+        len = strstr(arg, "..") - arg;
+    }
+    if(!flag){
+        for(i=0; groups[i].prefix; ++i){
+            for(j=0; _has_case(&groups[i], j); ++j){
+                Testcase_t *tcase = &groups[i].cases[j];
+                printf("    %s%s ", groups[i].prefix, tcase->name);
+                if(tcase->flags & MTSUITE_OFF_BY_DEFAULT){
+                    puts("   (Off by default)");
+                }else if(tcase->bench){
+                    puts("   (Benchmark)");
+                }else if(tcase->flags & MTSUITE_SKIP){
+                    puts("   (DISABLED)");
+                }else{ puts("");}
+            }
+        }
+    }
+    if(_index_build(groups)){ return 0; }
+    for(i=_index_lower_bound(arg, len); i < run->n_index; ++i){
+        Testcase_t *tcase = run->index_tab[i].tcase;
+        if(strncmp(run->index_tab[i].name, arg, len)){ break; }
+        if(set){tcase->flags |= flag;}
+        else{ tcase->flags &= ~flag; }
+        ++found;
+    }
+
+    return found;
+}
+
+// ---
+struct PlanEntry {
+    const Testgroup_t *group;
+    const Testcase_t *tcase;
+};
+
+struct ShardItem {
+    int idx;            /* into the plan */
+    double weight;      /* expected seconds */
+};
+
+static int _cmp_shard_item(const void *a, const void *b){
+    const struct ShardItem *x = a, *y = b;
+    if(x->weight != y->weight){ return x->weight < y->weight ? 1 : -1; }
+    return x->idx - y->idx;
+}
+
+/* Keep only the entries of `plan` that belong to shard opt_shard of
+ * opt_shards, in their original order, and return how many there are
+ * (-1 if memory runs out).
+ * Entries are dealt out longest first, each to the shard with the least
+ * expected time so far (ties go to the lower shard), so that the shards
+ * finish together.  A test with no recorded duration counts as the median
+ * recorded one; with no --durations at all this is a round robin.  Every
+ * machine computes the same split from the same plan. */
+static int _shard_plan(struct PlanEntry *plan, int n_plan){
+    Testrunner_t *run = _runner();
+    struct ShardItem *items;
+    double *load, *known, fallback = 1;
+    char *mine;
+    int n_known = 0, n_mine = 0, i, j;
+    items = malloc((n_plan ? n_plan : 1) * sizeof(*items));
+    known = malloc((n_plan ? n_plan : 1) * sizeof(*known));
+    load = calloc(run->opt_shards, sizeof(*load));
+    mine = calloc(n_plan ? n_plan : 1, 1);
+    if(!items || !known || !load || !mine){
+        perror("sharding the plan");
+        n_mine = -1;
+        goto done;
+    }
+    for(i=0; i < n_plan; ++i){
+        items[i].idx = i;
+        items[i].weight = _duration_of(plan[i].group, plan[i].tcase);
+        if(items[i].weight >= 0){ known[n_known++] = items[i].weight; }
+    }
+    if(n_known){ fallback = _median(known, n_known); }
+    for(i=0; i < n_plan; ++i){
+        if(plan[i].tcase->flags & (MTSUITE_SKIP|MTSUITE_OFF_BY_DEFAULT)){
+            items[i].weight = 0;
+        }else if(items[i].weight < 0){
+            items[i].weight = fallback;
+        }
+    }
+    qsort(items, n_plan, sizeof(*items), _cmp_shard_item);
+    for(i=0; i < n_plan; ++i){
+        int best = 0;
+        for(j=1; j < run->opt_shards; ++j){
+            if(load[j] < load[best]){ best = j; }
+        }
+        load[best] += items[i].weight;
+        if(best == run->opt_shard - 1){ mine[items[i].idx] = 1; }
+    }
+    for(i=0; i < n_plan; ++i){
+        if(mine[i]){ plan[n_mine++] = plan[i]; }
+    }
+    if(run->opt_verbosity > 1){
+        printf("Shard %d/%d: %d of %d tests, about %.3f s\n", run->opt_shard,
+            run->opt_shards, n_mine, n_plan, load[run->opt_shard - 1]);
+    }
+done:
+    free(items);
+    free(known);
+    free(load);
+    free(mine);
+    return n_mine;
+}
+
+/* Move the entries of `plan` that failed last time to the front, keeping
+ * the order within both parts; with --rerun-failed, drop the rest.
+ * Returns how many entries are left, or -1 if memory runs out. */
+static int _cache_order(struct PlanEntry *plan, int n_plan){
+    struct PlanEntry *rest;
+    int n_failed = 0, n_rest = 0, i;
+    if(!(rest = malloc((n_plan ? n_plan : 1) * sizeof(*rest)))){
+        perror("ordering the plan");
+        return -1;
+    }
+    for(i=0; i < n_plan; ++i){
+        if(_cache_failed(plan[i].group, plan[i].tcase)){
+            plan[n_failed++] = plan[i];
+        }else{
+            rest[n_rest++] = plan[i];
+        }
+    }
+    if(_runner()->opt_rerun_failed){
+        if(!n_failed && _runner()->opt_verbosity >= 0){
+            puts("No failed tests to rerun.");
+        }
+        n_rest = 0;
+    }
+    memcpy(plan + n_failed, rest, n_rest * sizeof(*rest));
+    free(rest);
+    return n_failed + n_rest;
+}
+
+/* Start reporting on the run of `plan`, whose runners use up to `tracks`
+ * trace tracks.  Failing to do so is reported but not fatal. */
+static void _status_open(
+    const struct PlanEntry *plan, int n_plan, int tracks
+){
+    Testrunner_t *run = _runner();
+    double *known;
+    int n_known = 0, i, r;
+    if(!run->status_fname && !run->status_sockname){ return; }
+    if(!(run->status_slots = calloc(tracks, sizeof(*run->status_slots))) ||
+            !(known = malloc((n_plan ? n_plan : 1) * sizeof(*known)))){
+        perror("starting status");
+        free(run->status_slots);
+        run->status_slots = NULL;
+        return;
+    }
+    run->n_status_slots = tracks;
+    for(i=0; i < n_plan; ++i){
+        double t = _duration_of(plan[i].group, plan[i].tcase);
+        if(t < 0){ t = _cache_seconds(plan[i].group, plan[i].tcase); }
+        if(t >= 0){ known[n_known++] = t; }
+    }
+    if(n_known){ run->status_fallback = _median(known, n_known); }
+    free(known);
+    run->status_total = n_plan;
+    run->status_work = 0;
+    for(i=0; i < n_plan; ++i){
+        run->status_work += _status_expected(plan[i].group, plan[i].tcase);
+    }
+    run->status_began = _monotonic_now();
+    if(run->status_sockname){
+        struct sockaddr_un addr;
+        struct stat sb;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(strlen(run->status_sockname) >= sizeof(addr.sun_path)){
+            fprintf(stderr, "%s: socket path too long\n",
+                run->status_sockname);
+        }else if(!lstat(run->status_sockname, &sb) && !S_ISSOCK(sb.st_mode)){
+            /* Only a socket left by an earlier run is ours to replace. */
+            fprintf(stderr, "%s: exists and is not a socket\n",
+                run->status_sockname);
+        }else if((run->status_sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC,
+                0)) == -1){
+            perror("status socket");
+        }else{
+            if(!SOCK_CLOEXEC){ fcntl(run->status_sock, F_SETFD, FD_CLOEXEC); }
+            strcpy(addr.sun_path, run->status_sockname);
+            unlink(run->status_sockname);
+            if(bind(run->status_sock, (struct sockaddr*)&addr, sizeof(addr)) ||
+                    listen(run->status_sock, 8)){
+                perror(run->status_sockname);
+                close(run->status_sock);
+                run->status_sock = -1;
+            }
+        }
+    }
+    if(_pipe_cloexec(run->status_wake)){
+        perror("starting status");
+        return;
+    }
+    if((r = pthread_create(&run->status_thread, NULL, _status_main, run))){
+        errno = r;
+        perror("starting status");
+        close(run->status_wake[0]);
+        close(run->status_wake[1]);
+        run->status_wake[0] = run->status_wake[1] = -1;
+    }
+}
+
+/* Trace track of job or pool worker `slot`. */
+static int _job_track(int slot){
+    return 1 + _runner()->opt_threads + slot;
+}
+
+/* How many of the `slots` that run side by side `tcase` occupies. */
+static int _testcase_cost(const Testcase_t *tcase, int slots){
+    if(tcase->exclusive){ return slots; }
+    if(!tcase->cpus){ return 1; }
+    return tcase->cpus < (unsigned)slots ? (int)tcase->cpus : slots;
+}
+
+/* How much of the opt_memory budget `tcase` takes: its .max_memory, but
+ * no more than all of it, so that it can still run on its own. */
+static unsigned long _testcase_memory(const Testcase_t *tcase){
+    unsigned long budget = _runner()->opt_memory;
+    return tcase->max_memory < budget ? tcase->max_memory : budget;
+}
+
+/* The machine's physical memory in bytes, or ULONG_MAX if unknown. */
+static unsigned long _physical_memory(void){
+#ifdef _SC_PHYS_PAGES
+    long pages = sysconf(_SC_PHYS_PAGES), size = sysconf(_SC_PAGESIZE);
+    if(pages > 0 && size > 0 &&
+            (unsigned long)pages <= ULONG_MAX / (unsigned long)size){
+        return (unsigned long)pages * (unsigned long)size;
+    }
+#endif
+    return ULONG_MAX;
+}
+
+/* Run every entry of `plan` in its own forked child, keeping up to
+ * `opt_jobs` slots busy at once: a test takes as many as its cost, and one
+ * that does not fit holds back those after it until enough are free, so
+ * heavy tests never oversubscribe and exclusive ones run alone.  The
+ * .max_memory of the tests running together is kept within opt_memory
+ * the same way.  Outcomes are collected with a single poll() over the
+ * children's pipes and counted exactly as mtsuite_run_one would count
+ * them. */
+static void _run_parallel(const struct PlanEntry *plan, int n_plan){
+    Testrunner_t *run = _runner();
+    struct ForkedChild *children;
+    struct pollfd *pfds;
+    int *slot_of;
+    int next = 0, running = 0, load = 0, i;
+    unsigned long memory = 0;
+
+    children = calloc(run->opt_jobs, sizeof(*children));
+    pfds = calloc(run->opt_jobs, sizeof(*pfds));
+    slot_of = calloc(run->opt_jobs, sizeof(*slot_of));
+    if(!children || !pfds || !slot_of){
+        perror("allocating job table");
+        run->broken = 1;
+        goto done;
+    }
+    for(i=0; i < run->opt_jobs; ++i){
+        children[i].fd = -1;
+        children[i].track = _job_track(i);
+    }
+
+    while((next < n_plan && !run->broken) || running){
+        struct ForkedChild *child;
+        int slot;
+        struct TestResult res;
+        while(running < run->opt_jobs && next < n_plan && !run->broken){
+            const struct PlanEntry *e = &plan[next];
+            int cost;
+            if(e->tcase->flags & (MTSUITE_SKIP|MTSUITE_OFF_BY_DEFAULT)){
+                ++next;
+                mtsuite_run_one(e->group, e->tcase);
+                continue;
+            }
+            cost = _testcase_cost(e->tcase, run->opt_jobs);
+            if(load + cost > run->opt_jobs ||
+                    _testcase_memory(e->tcase) > run->opt_memory - memory){
+                break;
+            }
+            ++next;
+            for(slot=0; children[slot].fd != -1; ++slot)
+                ;
+            if(_testcase_start_forked(e->group, e->tcase, &children[slot])){
+                if(run->opt_verbosity > 0){
+                    printf("%s%s: ", e->group->prefix, e->tcase->name);
+                }
+                memset(&res, 0, sizeof(res));
+                res.group = e->group;
+                res.tcase = e->tcase;
+                res.outcome = FAIL;
+                _count_outcome(&res);
+                continue;
+            }
+            _status_running(children[slot].track, e->group, e->tcase);
+            ++running;
+            load += cost;
+            memory += _testcase_memory(e->tcase);
+        }
+
+        slot = _wait_for_child(children, run->opt_jobs, pfds, slot_of);
+        if(slot < 0){
+            continue;
+        }
+        child = &children[slot];
+        if(run->opt_verbosity > 0){
+            printf("%s%s: ", child->group->prefix, child->tcase->name);
+        }else if(run->opt_verbosity == 0){
+            printf(".");
+        }
+        memset(&res, 0, sizeof(res));
+        res.group = child->group;
+        res.tcase = child->tcase;
+        _testcase_finish_forked(child, &res);
+        _count_outcome(&res);
+        /* Keep our lines ordered with the children's own output. */
+        fflush(stdout);
+        --running;
+        load -= _testcase_cost(child->tcase, run->opt_jobs);
+        memory -= _testcase_memory(child->tcase);
+    }
+
+done:
+    free(children);
+    free(pfds);
+    free(slot_of);
+}
+
+/* Persistent worker pool.  Each worker is forked once and then runs test
+ * after test: the parent writes plan indices (uint32) down the worker's
+ * command pipe, and the worker answers each with a frame on its result
+ * pipe: uint32 length, then the same outcome byte, TestResult and
+ * messages a forked child sends.  Up to MTSUITE_POOL_DEPTH tests are
+ * queued per worker so it never waits on the parent.  When a worker dies,
+ * the test it was running fails (or times out), the rest of its queue is
+ * handed out again, and a fresh worker takes its place. */
+#define MTSUITE_POOL_DEPTH 2
+
+struct PoolWorker {
+    pid_t pid;          /* 0 when not running */
+    int cmd_fd;         /* parent -> worker: plan indices */
+    int res_fd;         /* worker -> parent: result frames */
+    int queue[MTSUITE_POOL_DEPTH];  /* plan indices, running one first */
+    int n_queued;
+    double started;     /* when queue[0] started running */
+    double deadline;    /* for queue[0]; 0 = none */
+    int killed;         /* last signal sent by the watchdog, or 0 */
+    char *buf;          /* partial result frames */
+    size_t n_buf, buf_cap;
+    int cap_fds[2];     /* its stdout and stderr, or -1 */
+    off_t cap_done[2];  /* end of the output already accounted for */
+    int track;          /* its trace track */
+};
+
+static void _pool_release_worker(struct PoolWorker *worker){
+    close(worker->res_fd);
+    _capture_close_pair(worker->cap_fds);
+    worker->pid = 0;
+}
+
+/* Punch out output that has been passed on, so the pair stays small. */
+static void _pool_drop_output(struct PoolWorker *worker, int i, off_t end){
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if(end > worker->cap_done[i]){
+        fallocate(worker->cap_fds[i],
+            FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            worker->cap_done[i], end - worker->cap_done[i]);
+    }
+#endif
+    if(end > worker->cap_done[i]){ worker->cap_done[i] = end; }
+}
+
+/* Where the output of the test a pool worker is about to run starts. */
+static void _pool_output_mark(off_t start[2]){
+    fflush(stdout);
+    fflush(stderr);
+    start[0] = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    start[1] = lseek(STDERR_FILENO, 0, SEEK_CUR);
+}
+
+/* ... and, after it has run, where it ends. */
+static void _pool_output_range(off_t start[2], struct TestResult *res){
+    off_t end[2];
+    _pool_output_mark(end);
+    memset(&res->out, 0, sizeof(res->out));
+    memset(&res->err, 0, sizeof(res->err));
+    if(start[0] != -1 && end[0] >= start[0]){
+        res->out.off = start[0];
+        res->out.len = (size_t)(end[0] - start[0]);
+    }
+    if(start[1] != -1 && end[1] >= start[1]){
+        res->err.off = start[1];
+        res->err.len = (size_t)(end[1] - start[1]);
+    }
+}
+
+static int _read_all(int fd, void *buf, size_t len){
+    char *cp = buf;
+    while(len){
+        ssize_t r = read(fd, cp, len);
+        if(r < 0 && errno == EINTR){ continue; }
+        if(r <= 0){ return -1; }
+        cp += r;
+        len -= (size_t)r;
+    }
+    return 0;
+}
+
+static void _pool_worker_main(
+    const struct PlanEntry *plan, int cmd_fd, int res_fd
+){
+    unsigned idx;
+    while(!_read_all(cmd_fd, &idx, sizeof(idx))){
+        const struct PlanEntry *e = &plan[idx];
+        struct TestResult res;
+        double t0 = _monotonic_now();
+        off_t start[2];
+        unsigned len;
+        char b;
+        memset(&res, 0, sizeof(res));
+        _state_enter(e->group, e->tcase);
+        _pool_output_mark(start);
+        if(_testcase_forks(e->tcase)){
+            _testcase_run_forked(e->group, e->tcase, &res);
+            /* Our own output is what the parent looks at. */
+            fflush(stdout);
+            fflush(stderr);
+            _capture_copy(STDOUT_FILENO, &res.out);
+            _capture_copy(STDERR_FILENO, &res.err);
+            if(res.out.owned){ close(res.out.fd); }
+            if(res.err.owned){ close(res.err.fd); }
+        }else{
+            _testcase_run_inproc(e->tcase, &res);
+            res.t_wall = _monotonic_now() - t0;
+        }
+        res.t_begin = t0;
+        _pool_output_range(start, &res);
+        _trace_get(&res);
+        b = "NYSN"[res.outcome];
+        len = 1 + sizeof(res) + res.messages_len + res.trace_len;
+        if(_write_all(res_fd, &len, sizeof(len)) ||
+                _write_all(res_fd, &b, 1) ||
+                _write_all(res_fd, &res, sizeof(res)) ||
+                _write_all(res_fd, res.messages, res.messages_len) ||
+                _write_all(res_fd, res.trace, res.trace_len)){
+            perror("write outcome to pipe");
+            _child_exit(1);
+        }
+        _state()->trace_len = 0;
+    }
+    _child_exit(0);
+}
+
+static int _pool_start_worker(
+    struct PoolWorker *workers, int n_workers, int w,
+    const struct PlanEntry *plan
+){
+    struct PoolWorker *worker = &workers[w];
+    int cmd[2], res[2], cap[2];
+    pid_t pid;
+    if(_pipe_cloexec(cmd)){
+        perror("opening pipe");
+        return -1;
+    }
+    if(_pipe_cloexec(res)){
+        perror("opening pipe");
+        close(cmd[0]);
+        close(cmd[1]);
+        return -1;
+    }
+    _capture_pair(cap);
+    _runner_flush();
+    pid = fork();
+    if(pid == -1){
+        perror("fork");
+        close(cmd[0]); close(cmd[1]);
+        close(res[0]); close(res[1]);
+        _capture_close_pair(cap);
+        return -1;
+    }
+    if(!pid){
+        int i;
+        setpgid(0, 0);
+        /* Holding other workers' command pipes open would keep them from
+         * ever seeing EOF; so would our own tests' children holding ours. */
+        for(i=0; i < n_workers; ++i){
+            if(workers[i].pid){
+                close(workers[i].cmd_fd);
+                close(workers[i].res_fd);
+                _capture_close_pair(workers[i].cap_fds);
+            }
+        }
+        close(cmd[1]);
+        close(res[0]);
+        _capture_redirect(cap);
+        _capture_close_pair(cap);
+        _state()->trace_len = 0;
+        _runner()->worker_fds[0] = cmd[0];
+        _runner()->worker_fds[1] = res[1];
+        _pool_worker_main(plan, cmd[0], res[1]);
+    }
+    /* Its own process group, as for a forked test with a deadline. */
+    setpgid(pid, pid);
+    close(cmd[0]);
+    close(res[1]);
+    worker->cap_fds[0] = cap[0];
+    worker->cap_fds[1] = cap[1];
+    worker->cap_done[0] = worker->cap_done[1] = 0;
+    worker->pid = pid;
+    worker->track = _job_track(w);
+    worker->cmd_fd = cmd[1];
+    worker->res_fd = res[0];
+    worker->n_queued = 0;
+    worker->killed = 0;
+    worker->deadline = 0;
+    worker->n_buf = 0;
+    return 0;
+}
+
+/* queue[0] has just started running on `worker`: arm its deadline. */
+static void _pool_arm(
+    struct PoolWorker *worker, const struct PlanEntry *plan, double now
+){
+    double timeout;
+    worker->started = now;
+    worker->deadline = 0;
+    if(worker->n_queued){
+        const struct PlanEntry *e = &plan[worker->queue[0]];
+        timeout = _testcase_timeout(e->tcase);
+        /* A forked test has the worker's own watchdog, which also gets
+         * whatever the test started; ours only backs it up. */
+        if(timeout && _testcase_forks(e->tcase)){
+            timeout += 2 * MTSUITE_KILL_GRACE;
+        }
+        worker->deadline = timeout ? now + timeout : 0;
+        _status_running(worker->track, e->group, e->tcase);
+    }
+}
+
+/* Whether plan entry `idx` may be queued on `worker`.  Tests costing a
+ * single slot are queued freely; while a costlier one is waiting or
+ * running, everything queued on any worker counts against opt_jobs.  The
+ * .max_memory of everything queued stays within opt_memory.  A costly
+ * test, or one with a memory cap, only goes to an idle worker, and
+ * nothing queues behind it. */
+static int _pool_fits(
+    const struct PoolWorker *workers, const struct PoolWorker *worker,
+    const struct PlanEntry *plan, int idx
+){
+    Testrunner_t *run = _runner();
+    int cost = _testcase_cost(plan[idx].tcase, run->opt_jobs);
+    int load = 0, heavy = cost > 1, i, j;
+    unsigned long memory = 0;
+    if(worker->n_queued && (heavy || plan[idx].tcase->max_memory ||
+            _testcase_cost(plan[worker->queue[0]].tcase, run->opt_jobs) > 1 ||
+            plan[worker->queue[0]].tcase->max_memory)){
+        return 0;
+    }
+    for(i=0; i < run->opt_jobs; ++i){
+        for(j=0; j < workers[i].n_queued; ++j){
+            const Testcase_t *queued = plan[workers[i].queue[j]].tcase;
+            int c = _testcase_cost(queued, run->opt_jobs);
+            load += c;
+            heavy |= c > 1;
+            memory += _testcase_memory(queued);
+        }
+    }
+    if(_testcase_memory(plan[idx].tcase) > run->opt_memory - memory){
+        return 0;
+    }
+    return !heavy || load + cost <= run->opt_jobs;
+}
+
+static void _pool_announce(const struct PlanEntry *e){
+    if(_runner()->opt_verbosity > 0){
+        printf("%s%s: ", e->group->prefix, e->tcase->name);
+    }else if(_runner()->opt_verbosity == 0){
+        printf(".");
+    }
+}
+
+/* Count every complete frame in worker->buf. */
+static void _pool_take_results(
+    struct PoolWorker *worker, const struct PlanEntry *plan
+){
+    size_t off = 0;
+    unsigned len;
+    while(worker->n_queued && worker->n_buf - off >= sizeof(len)){
+        const struct PlanEntry *e = &plan[worker->queue[0]];
+        struct TestResult res, theirs;
+        const char *frame;
+        memcpy(&len, worker->buf + off, sizeof(len));
+        if(worker->n_buf - off - sizeof(len) < len){ break; }
+        frame = worker->buf + off + sizeof(len);
+        off += sizeof(len) + len;
+
+        memset(&res, 0, sizeof(res));
+        res.group = e->group;
+        res.tcase = e->tcase;
+        res.outcome = FAIL;
+        _messages_reset();
+        if(len >= 1 + sizeof(theirs)){
+            memcpy(&theirs, frame + 1, sizeof(theirs));
+            res = theirs;
+            res.group = e->group;
+            res.tcase = e->tcase;
+            res.outcome = frame[0] == 'Y' ? OK :
+                (frame[0] == 'S' ? SKIP : FAIL);
+            if(theirs.outcome == TIMEOUT){ res.outcome = TIMEOUT; }
+            res.track = worker->track;
+            if(theirs.messages_len + theirs.trace_len ==
+                    len - 1 - sizeof(theirs)){
+                _messages_append(frame + 1 + sizeof(theirs),
+                    theirs.messages_len);
+                if(_runner()->opt_trace){
+                    _trace_merge(frame + 1 + sizeof(theirs) +
+                        theirs.messages_len, theirs.trace_len, worker->track);
+                }
+            }
+            res.out.fd = worker->cap_fds[0];
+            res.err.fd = worker->cap_fds[1];
+            res.out.owned = res.err.owned = 0;
+            res.out.text = res.err.text = NULL;
+            if(worker->cap_fds[0] == -1){ res.out.len = res.err.len = 0; }
+        }
+        _messages_get(&res);
+        _pool_announce(e);
+        _count_outcome(&res);
+        fflush(stdout);
+        if(worker->cap_fds[0] != -1){
+            _pool_drop_output(worker, 0, res.out.off + res.out.len);
+            _pool_drop_output(worker, 1, res.err.off + res.err.len);
+        }
+
+        memmove(worker->queue, worker->queue + 1,
+            --worker->n_queued * sizeof(int));
+        _pool_arm(worker, plan, _monotonic_now());
+    }
+    memmove(worker->buf, worker->buf + off, worker->n_buf - off);
+    worker->n_buf -= off;
+}
+
+/* The worker's result pipe hit EOF: reap it, fail the test it was running
+ * and push the rest of its queue onto `retry`. */
+static void _pool_lost_worker(
+    struct PoolWorker *worker, const struct PlanEntry *plan,
+    int *retry, int *n_retry
+){
+    int status, r, i;
+    char note[64];
+    close(worker->cmd_fd);
+    do{
+        r = waitpid(worker->pid, &status, 0);
+    }while(r == -1 && errno == EINTR);
+    if(!worker->n_queued){
+        _pool_release_worker(worker);
+        return;
+    }
+
+    {
+        const struct PlanEntry *e = &plan[worker->queue[0]];
+        struct TestResult res;
+        memset(&res, 0, sizeof(res));
+        res.group = e->group;
+        res.tcase = e->tcase;
+        res.t_wall = _monotonic_now() - worker->started;
+        res.t_begin = worker->started;
+        res.track = worker->track;
+        _messages_reset();
+        if(worker->killed){
+            snprintf(note, sizeof(note), "timed out after %.3f s",
+                res.t_wall);
+            res.outcome = TIMEOUT;
+        }else{
+            if(r != -1 && WIFSIGNALED(status)){
+                snprintf(note, sizeof(note), "worker killed by signal %d",
+                    WTERMSIG(status));
+            }else{
+                snprintf(note, sizeof(note), "worker exited unexpectedly");
+            }
+            res.outcome = FAIL;
+        }
+        _messages_note(note);
+        _messages_get(&res);
+        /* Whatever it printed since its last result was this test's. */
+        for(i=0; i < 2 && worker->cap_fds[0] != -1; ++i){
+            struct Capture *cap = i ? &res.err : &res.out;
+            off_t end = (off_t)_capture_size(worker->cap_fds[i]);
+            cap->fd = worker->cap_fds[i];
+            cap->off = worker->cap_done[i];
+            cap->len = end > cap->off ? (size_t)(end - cap->off) : 0;
+        }
+        _pool_announce(e);
+        if(res.outcome == FAIL){ printf("[worker crashed] "); }
+        _count_outcome(&res);
+        fflush(stdout);
+    }
+    _pool_release_worker(worker);
+    /* Hand the rest out again, in their original order. */
+    for(i=worker->n_queued-1; i > 0; --i){
+        retry[(*n_retry)++] = worker->queue[i];
+    }
+    worker->n_queued = 0;
+}
+
+static void _run_pool(const struct PlanEntry *plan, int n_plan){
+    Testrunner_t *run = _runner();
+    struct PoolWorker *workers;
+    struct pollfd *pfds;
+    int *slot_of, *retry;
+    int next = 0, n_retry = 0, i;
+    sigset_t sigpipe, old_mask;
+
+    workers = calloc(run->opt_jobs, sizeof(*workers));
+    pfds = calloc(run->opt_jobs, sizeof(*pfds));
+    slot_of = calloc(run->opt_jobs, sizeof(*slot_of));
+    retry = calloc(run->opt_jobs * MTSUITE_POOL_DEPTH, sizeof(*retry));
+    if(!workers || !pfds || !slot_of || !retry){
+        perror("allocating worker pool");
+        run->broken = 1;
+        goto done;
+    }
+    /* A worker that dies must not take us with it when we write to it.
+     * Blocking SIGPIPE on this thread leaves the process's disposition, and
+     * the rest of its threads, alone. */
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+    /* Workers (and their replacements) inherit fixtures built by now. */
+    for(i=0; i < n_plan; ++i){
+        if(!(plan[i].tcase->flags & (MTSUITE_SKIP|MTSUITE_OFF_BY_DEFAULT))){
+            _fixture_acquire(plan[i].group);
+        }
+    }
+
+    for(;;){
+        double now = _monotonic_now(), wake = 0;
+        int n_fds = 0, busy = 0, timeout_ms = -1, r;
+
+        if(run->broken){
+            /* What the workers hold fails; the rest does not run. */
+            for(i=0; i < run->opt_jobs; ++i){
+                if(!workers[i].pid){ continue; }
+                kill(-workers[i].pid, SIGKILL);
+                _pool_lost_worker(&workers[i], plan, retry, &n_retry);
+            }
+            break;
+        }
+        for(i=0; i < run->opt_jobs; ++i){
+            struct PoolWorker *worker = &workers[i];
+            while(worker->n_queued < MTSUITE_POOL_DEPTH &&
+                    (n_retry || next < n_plan)){
+                int idx = n_retry ? retry[n_retry - 1] : next;
+                unsigned cmd;
+                if(!n_retry && plan[idx].tcase->flags &
+                        (MTSUITE_SKIP|MTSUITE_OFF_BY_DEFAULT)){
+                    ++next;
+                    mtsuite_run_one(plan[idx].group, plan[idx].tcase);
+                    continue;
+                }
+                if(!_pool_fits(workers, worker, plan, idx)){ break; }
+                if(n_retry){
+                    --n_retry;
+                }else{
+                    ++next;
+                }
+                if(!worker->pid &&
+                        _pool_start_worker(workers, run->opt_jobs, i, plan)){
+                    struct TestResult res;
+                    memset(&res, 0, sizeof(res));
+                    res.group = plan[idx].group;
+                    res.tcase = plan[idx].tcase;
+                    res.outcome = FAIL;
+                    _pool_announce(&plan[idx]);
+                    _count_outcome(&res);
+                    break;
+                }
+                cmd = (unsigned)idx;
+                if(_write_all(worker->cmd_fd, &cmd, sizeof(cmd))){
+                    /* Dying; the EOF on its result pipe will clean up. */
+                    retry[n_retry++] = idx;
+                    break;
+                }
+                worker->queue[worker->n_queued++] = idx;
+                if(worker->n_queued == 1){ _pool_arm(worker, plan, now); }
+            }
+        }
+
+        for(i=0; i < run->opt_jobs; ++i){
+            struct PoolWorker *worker = &workers[i];
+            if(!worker->pid){ continue; }
+            if(!worker->n_queued && !n_retry && next >= n_plan){
+                /* No more work: closing the command pipe ends it. */
+                close(worker->cmd_fd);
+                worker->cmd_fd = -1;
+                while(waitpid(worker->pid, NULL, 0) == -1 && errno == EINTR)
+                    ;
+                _pool_release_worker(worker);
+                continue;
+            }
+            busy += worker->n_queued;
+            if(worker->deadline && now >= worker->deadline){
+                /* The worker's group: it and whatever its test started. */
+                if(worker->killed == SIGTERM){
+                    kill(-worker->pid, SIGKILL);
+                    worker->killed = SIGKILL;
+                    worker->deadline = 0;   /* nothing left but to reap */
+                }else{
+                    kill(-worker->pid, SIGTERM);
+                    worker->killed = SIGTERM;
+                    worker->deadline = now + MTSUITE_KILL_GRACE;
+                }
+            }
+            if(worker->deadline && (!wake || worker->deadline < wake)){
+                wake = worker->deadline;
+            }
+            pfds[n_fds].fd = worker->res_fd;
+            pfds[n_fds].events = POLLIN;
+            pfds[n_fds].revents = 0;
+            slot_of[n_fds++] = i;
+        }
+        if(!n_fds){
+            if(!busy && !n_retry && next >= n_plan){ break; }
+            continue;
+        }
+
+        if(wake){
+            timeout_ms = _poll_timeout(wake - now);
+        }
+        r = poll(pfds, n_fds, timeout_ms);
+        _trace_span(TRACE_RUNNER, "wait", now, _monotonic_now());
+        if(r == -1){
+            if(errno != EINTR){
+                perror("poll");
+                run->broken = 1;
+            }
+            continue;
+        }
+        for(i=0; i < n_fds; ++i){
+            struct PoolWorker *worker = &workers[slot_of[i]];
+            char buf[4096];
+            ssize_t got;
+            if(!pfds[i].revents){ continue; }
+            do{
+                got = read(worker->res_fd, buf, sizeof(buf));
+            }while(got == -1 && errno == EINTR);
+            if(got > 0){
+                if(worker->n_buf + got > worker->buf_cap){
+                    size_t cap = worker->buf_cap ? worker->buf_cap * 2 :
+                        2 * sizeof(buf) + sizeof(struct TestResult);
+                    char *nbuf;
+                    while(cap < worker->n_buf + got){ cap *= 2; }
+                    if(!(nbuf = realloc(worker->buf, cap))){
+                        perror("reading results");
+                        run->broken = 1;
+                        break;
+                    }
+                    worker->buf = nbuf;
+                    worker->buf_cap = cap;
+                }
+                memcpy(worker->buf + worker->n_buf, buf, got);
+                worker->n_buf += got;
+                if(!worker->killed){
+                    _pool_take_results(worker, plan);
+                }
+            }else{
+                _pool_lost_worker(worker, plan, retry, &n_retry);
+            }
+        }
+    }
+
+    if(!sigismember(&old_mask, SIGPIPE)){
+        /* Take any we raised before it is let through again. */
+        struct timespec zero = { 0, 0 };
+        while(sigtimedwait(&sigpipe, NULL, &zero) == SIGPIPE)
+            ;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    for(i=0; i < run->opt_jobs; ++i){ free(workers[i].buf); }
+done:
+    free(workers);
+    free(pfds);
+    free(slot_of);
+    free(retry);
+}
+
+/* In-process thread pool for --threads.  Only tests that need no child
+ * and no machine of their own (no MTSUITE_FORK or memory cap, no deadline,
+ * no benchmarks, exclusive or multi-CPU tests) run on it.  They are cut
+ * into one contiguous range per thread; a thread takes tests from the
+ * front of its own range and, once that is empty, steals the back half of
+ * the fullest other one.  Outcomes are counted under count_lock. */
+struct ThreadRange {
+    pthread_mutex_t lock;
+    int head, tail;
+};
+
+struct ThreadWorker {
+    pthread_t thread;
+    Testrunner_t *runner;
+    struct ThreadRange range;
+    struct TestState state;
+    const struct PlanEntry *plan;
+    struct ThreadWorker *all;
+    int n_all;
+};
+
+static int _threads_take(struct ThreadWorker *self){
+    struct ThreadRange *own = &self->range;
+    int idx = -1;
+    pthread_mutex_lock(&own->lock);
+    if(own->head < own->tail){ idx = own->head++; }
+    pthread_mutex_unlock(&own->lock);
+    while(idx == -1){
+        struct ThreadWorker *victim = NULL;
+        int most = 0, lo = 0, hi = 0, i;
+        for(i=0; i < self->n_all; ++i){
+            struct ThreadRange *r = &self->all[i].range;
+            int left;
+            if(&self->all[i] == self){ continue; }
+            pthread_mutex_lock(&r->lock);
+            left = r->tail - r->head;
+            pthread_mutex_unlock(&r->lock);
+            if(left > most){
+                most = left;
+                victim = &self->all[i];
+            }
+        }
+        if(!victim){ return -1; }
+        pthread_mutex_lock(&victim->range.lock);
+        if(victim->range.head < victim->range.tail){
+            hi = victim->range.tail;
+            lo = hi - (hi - victim->range.head + 1) / 2;
+            victim->range.tail = lo;
+        }
+        pthread_mutex_unlock(&victim->range.lock);
+        if(lo < hi){
+            pthread_mutex_lock(&own->lock);
+            own->head = lo + 1;
+            own->tail = hi;
+            pthread_mutex_unlock(&own->lock);
+            idx = lo;
+        }
+    }
+    return idx;
+}
+
+static void *_threads_main(void *arg){
+    struct ThreadWorker *self = arg;
+    Testrunner_t *run = cur_runner = self->runner;
+    int idx;
+    cur_state = &self->state;
+    while((idx = _threads_take(self)) != -1){
+        const struct PlanEntry *e = &self->plan[idx];
+        struct TestResult res;
+        double t0 = _monotonic_now();
+        memset(&res, 0, sizeof(res));
+        res.group = e->group;
+        res.tcase = e->tcase;
+        _state_enter(e->group, e->tcase);
+        _status_running(self->state.trace_track, e->group, e->tcase);
+        self->state.out_len = 0;
+        _testcase_run_inproc(e->tcase, &res);
+        res.t_wall = _monotonic_now() - t0;
+        res.t_begin = t0;
+        res.track = self->state.trace_track;
+        res.out.text = self->state.out;
+        res.out.len = self->state.out_len;
+        pthread_mutex_lock(&run->count_lock);
+        if(run->opt_verbosity > 0){
+            printf("%s%s: ", e->group->prefix, e->tcase->name);
+        }else if(run->opt_verbosity == 0){
+            printf(".");
+        }
+        _count_outcome(&res);
+        pthread_mutex_unlock(&run->count_lock);
+    }
+    return NULL;
+}
+
+/* Run the entries of `plan` that suit the thread pool on opt_threads
+ * threads, move the others to the front of `plan` in their original
+ * order, and return how many of those are left (none once the runner is
+ * broken). */
+static int _run_threads(struct PlanEntry *plan, int n_plan){
+    Testrunner_t *run = _runner();
+    struct PlanEntry *threaded;
+    struct ThreadWorker *workers;
+    int n_threaded = 0, n_rest = 0, n_workers = run->opt_threads;
+    int n_started, i;
+    if(!(threaded = malloc((n_plan ? n_plan : 1) * sizeof(*threaded)))){
+        perror("allocating thread plan");
+        run->broken = 1;
+        return 0;
+    }
+    for(i=0; i < n_plan; ++i){
+        const Testcase_t *tcase = plan[i].tcase;
+        if((tcase->flags & (MTSUITE_SKIP|MTSUITE_OFF_BY_DEFAULT)) ||
+                tcase->exclusive || tcase->cpus > 1 ||
+                _testcase_forks(tcase) || tcase->bench ||
+                _testcase_timeout(tcase)){
+            plan[n_rest++] = plan[i];
+        }else{
+            threaded[n_threaded++] = plan[i];
+        }
+    }
+    if(n_workers > n_threaded){ n_workers = n_threaded; }
+    if(!n_workers){
+        free(threaded);
+        return n_rest;
+    }
+    if(!(workers = calloc(n_workers, sizeof(*workers)))){
+        perror("allocating thread pool");
+        run->broken = 1;
+        free(threaded);
+        return 0;
+    }
+    run->main_state.outcome = OK;
+    for(i=0; i < n_workers; ++i){
+        struct ThreadWorker *w = &workers[i];
+        pthread_mutex_init(&w->range.lock, NULL);
+        pthread_mutex_init(&w->state.lock, NULL);
+        w->runner = run;
+        w->state.trace_track = 1 + i;
+        w->range.head = (int)((long)n_threaded * i / n_workers);
+        w->range.tail = (int)((long)n_threaded * (i + 1) / n_workers);
+        w->plan = threaded;
+        w->all = workers;
+        w->n_all = n_workers;
+    }
+    for(n_started=0; n_started < n_workers; ++n_started){
+        int r = pthread_create(&workers[n_started].thread, NULL,
+            _threads_main, &workers[n_started]);
+        if(r){
+            /* Those started steal the ranges of those that were not. */
+            errno = r;
+            perror("pthread_create");
+            run->broken = 1;
+            break;
+        }
+    }
+    for(i=0; i < n_started; ++i){
+        pthread_join(workers[i].thread, NULL);
+    }
+    for(i=0; i < n_workers; ++i){
+        free(workers[i].state.msg_buf);
+        free(workers[i].state.out);
+        _counters_close(&workers[i].state);
+        if(run->opt_trace){
+            _trace_merge(workers[i].state.trace, workers[i].state.trace_len,
+                workers[i].state.trace_track);
+        }
+        free(workers[i].state.trace);
+        _arena_free(&workers[i].state);
+        runner_free(workers[i].state.heap_blocks);
+        pthread_mutex_destroy(&workers[i].state.lock);
+        pthread_mutex_destroy(&workers[i].range.lock);
+    }
+    /* A helper thread of a threaded test cannot be told apart from the
+     * others; all that can be said is that one of them failed. */
+    if(run->main_state.outcome == FAIL){
+        printf("\n  [an assertion failed outside the thread running its "
+            "test]\n");
+        ++run->n_bad;
+    }
+    free(workers);
+    free(threaded);
+    return run->broken ? 0 : n_rest;
+}
+
+/* Async tests.  An async case's callback only starts it: it registers
+ * waits, for a descriptor to become ready or for a delay to pass, whose
+ * continuations carry the test on, and the test is over once none is left
+ * or one of them has failed it.  An event loop owned by the runner (epoll,
+ * or poll() where there is none) keeps up to --async=N of them in flight in
+ * this process, each with a TestState of its own made current around its
+ * continuations, so that failures, messages and output land on the right
+ * test.  The loop runs to the end before any other test starts, and it
+ * keeps their deadlines itself: there is no watchdog to stop a
+ * continuation that blocks.  Run any other way (in a child, or through
+ * mtsuite_run_one), an async test gets a loop to itself inside its
+ * callback phase. */
+enum AsyncKind { ASYNC_FD, ASYNC_TIMER, ASYNC_DEADLINE };
+
+struct AsyncWait {
+    struct AsyncTest *test;         /* NULL once dropped */
+    struct AsyncWait *prev, *next;  /* the test's live waits, or dead ones */
+    enum AsyncKind kind;
+    int fd;
+    unsigned events;
+    double when;            /* timers and deadlines: monotonic */
+    /* Timers and deadlines: in loop->timers; without epoll, descriptors:
+     * in loop->fds. */
+    int heap_idx;
+    TAsyncFdFn_t on_fd;
+    TAsyncTimerFn_t on_timer;
+    void *arg;
+};
+
+struct AsyncLoop {
+#ifdef __linux__
+    int epfd;
+#else
+    /* The descriptors waited for, polled afresh each step, and what the
+     * step polled: both arrays are its own, so that continuations may add
+     * and drop waits while it goes through them. */
+    struct AsyncWait **fds;
+    int n_fds, fds_cap;
+    struct pollfd *pfds;
+    struct AsyncWait **polled;
+    int polled_cap;
+#endif
+    struct AsyncWait **timers;  /* binary min-heap on `when` */
+    int n_timers, timers_cap;
+    /* Dropped waits, freed between steps: an event for one may still be
+     * among those the step is going through. */
+    struct AsyncWait *dead;
+    int n_live;                 /* tests in flight */
+};
+
+struct AsyncTest {
+    struct AsyncLoop *loop;
+    struct TestState *state;
+    const struct PlanEntry *entry;  /* NULL when run inline */
+    int live;
+    struct TestResult res;
+    void *env;
+    double t0, t1;
+    struct AsyncWait *waits;
+    int n_pending;          /* live waits, not counting the deadline */
+    int timed_out;
+};
+
+static void _async_heap_set(
+    struct AsyncLoop *loop, int i, struct AsyncWait *w
+){
+    loop->timers[i] = w;
+    w->heap_idx = i;
+}
+
+/* Move the timer at `i` up or down to where it belongs. */
+static void _async_heap_fix(struct AsyncLoop *loop, int i){
+    struct AsyncWait **h = loop->timers, *w = h[i];
+    while(i > 0 && h[(i - 1) / 2]->when > w->when){
+        _async_heap_set(loop, i, h[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    for(;;){
+        int c = 2 * i + 1;
+        if(c >= loop->n_timers){ break; }
+        if(c + 1 < loop->n_timers && h[c + 1]->when < h[c]->when){ ++c; }
+        if(h[c]->when >= w->when){ break; }
+        _async_heap_set(loop, i, h[c]);
+        i = c;
+    }
+    _async_heap_set(loop, i, w);
+}
+
+static int _async_heap_push(struct AsyncLoop *loop, struct AsyncWait *w){
+    if(loop->n_timers == loop->timers_cap){
+        int cap = loop->timers_cap ? loop->timers_cap * 2 : 64;
+        struct AsyncWait **h = runner_realloc(loop->timers, cap * sizeof(*h));
+        if(!h){ return -1; }
+        loop->timers = h;
+        loop->timers_cap = cap;
+    }
+    loop->timers[loop->n_timers++] = w;
+    _async_heap_fix(loop, loop->n_timers - 1);
+    return 0;
+}
+
+static void _async_heap_remove(struct AsyncLoop *loop, struct AsyncWait *w){
+    int i = w->heap_idx;
+    struct AsyncWait *last = loop->timers[--loop->n_timers];
+    if(i < loop->n_timers){
+        loop->timers[i] = last;
+        _async_heap_fix(loop, i);
+    }
+}
+
+static struct AsyncWait *_async_add(
+    struct AsyncTest *at, enum AsyncKind kind, int fd, unsigned events,
+    double when
+){
+    struct AsyncWait *w = runner_realloc(NULL, sizeof(*w));
+    if(!w){ return NULL; }
+    memset(w, 0, sizeof(*w));
+    w->test = at;
+    w->kind = kind;
+    w->fd = fd;
+    w->events = events;
+    w->when = when;
+    if(kind == ASYNC_FD){
+#ifdef __linux__
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = w;
+        if(epoll_ctl(at->loop->epfd, EPOLL_CTL_ADD, fd, &ev)){
+            int e = errno;
+            runner_free(w);
+            errno = e;
+            return NULL;
+        }
+#else
+        struct AsyncLoop *loop = at->loop;
+        if(loop->n_fds == loop->fds_cap){
+            int cap = loop->fds_cap ? loop->fds_cap * 2 : 64;
+            struct AsyncWait **fds =
+                runner_realloc(loop->fds, cap * sizeof(*fds));
+            if(!fds){
+                runner_free(w);
+                errno = ENOMEM;
+                return NULL;
+            }
+            loop->fds = fds;
+            loop->fds_cap = cap;
+        }
+        w->heap_idx = loop->n_fds;
+        loop->fds[loop->n_fds++] = w;
+#endif
+    }else if(_async_heap_push(at->loop, w)){
+        runner_free(w);
+        errno = ENOMEM;
+        return NULL;
+    }
+    w->next = at->waits;
+    if(at->waits){ at->waits->prev = w; }
+    at->waits = w;
+    if(kind != ASYNC_DEADLINE){ ++at->n_pending; }
+    return w;
+}
+
+static void _async_drop(struct AsyncWait *w){
+    struct AsyncTest *at = w->test;
+    struct AsyncLoop *loop = at->loop;
+    if(w->prev){
+        w->prev->next = w->next;
+    }else{
+        at->waits = w->next;
+    }
+    if(w->next){ w->next->prev = w->prev; }
+    if(w->kind == ASYNC_FD){
+#ifdef __linux__
+        /* Fails harmlessly if the test has closed it already. */
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+#else
+        struct AsyncWait *last = loop->fds[--loop->n_fds];
+        if(w->heap_idx < loop->n_fds){
+            loop->fds[w->heap_idx] = last;
+            last->heap_idx = w->heap_idx;
+        }
+#endif
+    }else{
+        _async_heap_remove(loop, w);
+    }
+    if(w->kind != ASYNC_DEADLINE){ --at->n_pending; }
+    w->test = NULL;
+    w->next = loop->dead;
+    loop->dead = w;
+}
+
+static int _async_loop_init(struct AsyncLoop *loop){
+    memset(loop, 0, sizeof(*loop));
+#ifdef __linux__
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->epfd == -1 ? -1 : 0;
+#else
+    return 0;
+#endif
+}
+
+static void _async_loop_reap(struct AsyncLoop *loop){
+    while(loop->dead){
+        struct AsyncWait *next = loop->dead->next;
+        runner_free(loop->dead);
+        loop->dead = next;
+    }
+}
+
+static void _async_loop_close(struct AsyncLoop *loop){
+    _async_loop_reap(loop);
+    runner_free(loop->timers);
+#ifdef __linux__
+    close(loop->epfd);
+#else
+    runner_free(loop->fds);
+    runner_free(loop->pfds);
+    runner_free(loop->polled);
+#endif
+}
+
+/* Count a test the loop ran to the end. */
+static void _async_report(struct AsyncTest *at){
+    const struct PlanEntry *e = at->entry;
+    double now = _monotonic_now();
+    at->res.t_wall = now - at->t0;
+    at->res.t_begin = at->t0;
+    at->res.track = at->state->trace_track;
+    at->res.out.text = at->state->out;
+    at->res.out.len = at->state->out_len;
+    if(_runner()->opt_verbosity > 0){
+        printf("%s%s: ", e->group->prefix, e->tcase->name);
+    }else if(_runner()->opt_verbosity == 0){
+        printf(".");
+    }
+    _count_outcome(&at->res);
+}
+
+static void _async_finish(struct AsyncTest *at){
+    struct TestState *saved = cur_state;
+    double t2 = _monotonic_now();
+    enum Outcome outcome;
+    while(at->waits){ _async_drop(at->waits); }
+    --at->loop->n_live;
+    at->live = 0;
+    at->state->async = NULL;
+    if(!at->entry){ return; }
+    cur_state = at->state;
+    outcome = at->timed_out ? TIMEOUT : at->state->outcome;
+    at->res.outcome = _testcase_end(at->entry->tcase, at->env, &at->res,
+        outcome, at->t0, at->t1, t2);
+    cur_state = saved;
+    _async_report(at);
+}
+
+/* After its callback or a continuation: end the test if it is over. */
+static void _async_settle(struct AsyncTest *at){
+    if(!at->n_pending || at->state->outcome == FAIL){
+        _async_finish(at);
+    }
+}
+
+static void _async_fire(struct AsyncWait *w, unsigned events){
+    struct AsyncTest *at = w->test;
+    struct TestState *saved = cur_state;
+    TAsyncFdFn_t on_fd = w->on_fd;
+    TAsyncTimerFn_t on_timer = w->on_timer;
+    void *arg = w->arg;
+    int fd = w->fd;
+    if(!at){ return; }
+    if(w->kind == ASYNC_DEADLINE){
+        at->timed_out = 1;
+        _async_finish(at);
+        return;
+    }
+    _async_drop(w);
+    /* Inline, the test's state is current already. */
+    if(at->entry){ cur_state = at->state; }
+    if(on_fd){
+        on_fd(arg, fd, events);
+    }else{
+        on_timer(arg);
+    }
+    cur_state = saved;
+    _async_settle(at);
+}
+
+/* Wait for the next events and timers that are due, and run theirs.
+ * Returns -1 if waiting fails. */
+static int _async_loop_step(struct AsyncLoop *loop){
+#ifdef __linux__
+    struct epoll_event evs[64];
+#else
+    int n_polled = loop->n_fds;
+#endif
+    double now = _monotonic_now();
+    int timeout_ms = -1, n, i;
+    if(loop->n_timers){
+        timeout_ms = _poll_timeout(loop->timers[0]->when - now);
+    }
+#ifdef __linux__
+    n = epoll_wait(loop->epfd, evs, sizeof(evs) / sizeof(*evs), timeout_ms);
+    if(n == -1 && errno != EINTR){
+        perror("epoll_wait");
+        return -1;
+    }
+#else
+    if(loop->n_fds > loop->polled_cap){
+        struct pollfd *pfds = runner_realloc(loop->pfds,
+            loop->fds_cap * sizeof(*pfds));
+        struct AsyncWait **polled;
+        if(pfds){ loop->pfds = pfds; }
+        polled = runner_realloc(loop->polled,
+            loop->fds_cap * sizeof(*polled));
+        if(polled){ loop->polled = polled; }
+        if(!pfds || !polled){
+            perror("polling async tests");
+            return -1;
+        }
+        loop->polled_cap = loop->fds_cap;
+    }
+    for(i=0; i < loop->n_fds; ++i){
+        loop->pfds[i].fd = loop->fds[i]->fd;
+        loop->pfds[i].events = (short)loop->fds[i]->events;
+        loop->pfds[i].revents = 0;
+        loop->polled[i] = loop->fds[i];
+    }
+    n = poll(loop->pfds, loop->n_fds, timeout_ms);
+    if(n == -1 && errno != EINTR){
+        perror("poll");
+        return -1;
+    }
+#endif
+    if(_runner()->opt_trace){
+        _trace_span(TRACE_RUNNER, "wait", now, _monotonic_now());
+    }
+#ifdef __linux__
+    for(i=0; i < n; ++i){
+        _async_fire(evs[i].data.ptr, evs[i].events);
+    }
+#else
+    for(i=0; n > 0 && i < n_polled; ++i){
+        if(loop->pfds[i].revents){
+            --n;
+            _async_fire(loop->polled[i],
+                (unsigned short)loop->pfds[i].revents);
+        }
+    }
+#endif
+    now = _monotonic_now();
+    while(loop->n_timers && loop->timers[0]->when <= now){
+        _async_fire(loop->timers[0], 0);
+    }
+    _async_loop_reap(loop);
+    return 0;
+}
+
+/* Its loop failed: fail `at` if it is still running. */
+static void _async_abandon(struct AsyncTest *at){
+    struct TestState *saved = cur_state;
+    if(!at->live){ return; }
+    cur_state = at->state;
+    _messages_note("its event loop failed");
+    at->state->outcome = FAIL;
+    cur_state = saved;
+    _async_finish(at);
+}
+
+/* The callback phase of an async test run on its own, in the current
+ * state. */
+static void _async_run_inline(const Testcase_t *tcase, void *env){
+    struct AsyncLoop loop;
+    struct AsyncTest at;
+    if(_async_loop_init(&loop)){
+        _messages_note("could not create its event loop");
+        _state()->outcome = FAIL;
+        return;
+    }
+    memset(&at, 0, sizeof(at));
+    at.loop = &loop;
+    at.state = _state();
+    at.live = 1;
+    ++loop.n_live;
+    at.state->async = &at;
+    tcase->async(env);
+    _async_settle(&at);
+    while(loop.n_live){
+        if(_async_loop_step(&loop)){ _async_abandon(&at); }
+    }
+    _async_loop_close(&loop);
+}
+
+/* Set plan entry `e` going on `at`. */
+static void _async_start(struct AsyncTest *at, const struct PlanEntry *e){
+    struct TestState *saved = cur_state;
+    double timeout = _testcase_timeout(e->tcase);
+    enum Outcome outcome;
+    memset(&at->res, 0, sizeof(at->res));
+    at->res.group = e->group;
+    at->res.tcase = e->tcase;
+    at->entry = e;
+    at->waits = NULL;
+    at->n_pending = 0;
+    at->timed_out = 0;
+    cur_state = at->state;
+    _state_enter(e->group, e->tcase);
+    _status_running(at->state->trace_track, e->group, e->tcase);
+    at->state->out_len = 0;
+    outcome = _testcase_begin(e->tcase, &at->res, &at->env, &at->t0);
+    if(outcome != OK){
+        cur_state = saved;
+        at->res.outcome = outcome;
+        _async_report(at);
+        return;
     }
+    at->live = 1;
+    ++at->loop->n_live;
+    at->t1 = _monotonic_now();
+    at->state->async = at;
+    if(timeout && !_async_add(at, ASYNC_DEADLINE, -1, 0, at->t1 + timeout)){
+        _messages_note("could not arm its deadline");
+        at->state->outcome = FAIL;
+    }else{
+        e->tcase->async(at->env);
+    }
+    cur_state = saved;
+    _async_settle(at);
+}
 
-    if(opt_verbosity > 0){
-        printf("[forking] ");
+/* Run the async entries of `plan` that need no child of their own on the
+ * runner's loop, up to opt_async at once, move the others to the front of
+ * `plan` in their original order, and return how many of those are left
+ * (none once the runner is broken). */
+static int _run_async(struct PlanEntry *plan, int n_plan){
+    Testrunner_t *run = _runner();
+    struct PlanEntry *batch;
+    struct TestState *states;
+    struct AsyncTest *tests;
+    struct AsyncLoop loop;
+    int n_batch = 0, n_rest = 0, n_slots, next = 0, i;
+    if(!(batch = malloc((n_plan ? n_plan : 1) * sizeof(*batch)))){
+        perror("allocating async plan");
+        run->broken = 1;
+        return 0;
     }
-    pid = fork();
-    if(!pid){
-        /* child */
-        int testr, writer;
-        char b[1];
-        close(outpipe[0]);
-        testr = _testcase_run_bare(tcase);
-        assert(0<=(int)testr && (int)testr<= 2);
-        b[0] = "NYS"[testr];
-        writer = (int)write(outpipe[1], b, 1);
-        if(writer != 1){
-            perror("write outcome to pipe");
-            exit(1);
+    for(i=0; i < n_plan; ++i){
+        const Testcase_t *tcase = plan[i].tcase;
+        if(tcase->async && !_testcase_forks(tcase) &&
+                !(tcase->flags & (MTSUITE_SKIP|MTSUITE_OFF_BY_DEFAULT))){
+            batch[n_batch++] = plan[i];
+        }else{
+            plan[n_rest++] = plan[i];
         }
-        exit(0);
-        return FAIL; /* unreachable */
-    }else{
-        /* parent */
-        int status, r;
-        char b[1];
-        close(outpipe[1]);
-        r = (int)read(outpipe[0], b, 1);
-        if(r == 0){
-            printf("[Lost connection!] ");
-            return FAIL;
-        }else if(r != 1){
-            perror("read outcome from pipe");
-        }
-        r = waitpid(pid, &status, 0);
-        close(outpipe[0]);
-        if(r == -1){
-            perror("waitpid");
-            return FAIL;
+    }
+    if(!n_batch){
+        free(batch);
+        return n_rest;
+    }
+    n_slots = run->opt_async < n_batch ? run->opt_async : n_batch;
+    states = calloc(n_slots, sizeof(*states));
+    tests = calloc(n_slots, sizeof(*tests));
+    if(!states || !tests || _async_loop_init(&loop)){
+        perror("starting async tests");
+        run->broken = 1;
+        free(states);
+        free(tests);
+        free(batch);
+        return 0;
+    }
+    for(i=0; i < n_slots; ++i){
+        pthread_mutex_init(&states[i].lock, NULL);
+        states[i].trace_track = _job_track(run->opt_jobs + i);
+        tests[i].loop = &loop;
+        tests[i].state = &states[i];
+    }
+    while((next < n_batch && !run->broken) || loop.n_live){
+        for(i=0; i < n_slots && next < n_batch && !run->broken; ++i){
+            if(!tests[i].live){ _async_start(&tests[i], &batch[next++]); }
         }
-        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
-            printf("[did not exit cleanly.]");
-            return FAIL;
+        if(loop.n_live && _async_loop_step(&loop)){
+            run->broken = 1;
+            for(i=0; i < n_slots; ++i){ _async_abandon(&tests[i]); }
         }
-
-        return b[0] == 'Y' ? OK : (b[0] == 'S' ? SKIP : FAIL);
     }
+    _async_loop_close(&loop);
+    for(i=0; i < n_slots; ++i){
+        if(run->opt_trace){
+            _trace_merge(states[i].trace, states[i].trace_len,
+                states[i].trace_track);
+        }
+        free(states[i].trace);
+        free(states[i].msg_buf);
+        free(states[i].out);
+        _arena_free(&states[i]);
+        runner_free(states[i].heap_blocks);
+        pthread_mutex_destroy(&states[i].lock);
+    }
+    free(states);
+    free(tests);
+    free(batch);
+    return run->broken ? 0 : n_rest;
 }
 
 // ---
-int mtsuite_run_one(
-    const struct Testgroup_t *group, const struct Testcase_t *tcase
+int mtsuite_async_wait_fd(
+    int fd, unsigned events, TAsyncFdFn_t fn, void *arg
 ){
-    enum Outcome outcome;
-    if(tcase->flags & (MTSUITE_SKIP|MTSUITE_OFF_BY_DEFAULT)){
-        if(opt_verbosity > 0){
-            printf(
-                "%s%s: %s\n",
-                group->prefix, tcase->name,
-                (tcase->flags & MTSUITE_SKIP) ? "SKIPPED" : "DISABLED"
-            );
-        }
-        ++n_skipped;
-        return SKIP;
+    struct AsyncTest *at = _state()->async;
+    struct AsyncWait *w;
+    if(!at){
+        errno = EINVAL;
+        return -1;
     }
+    if(!(w = _async_add(at, ASYNC_FD, fd, events, 0))){ return -1; }
+    w->on_fd = fn;
+    w->arg = arg;
+    return 0;
+}
 
-    if(opt_verbosity == 0){ printf("."); }
-    cur_test_prefix = group->prefix;
-    cur_test_name = tcase->name;
-    outcome = _testcase_run_bare(tcase);
-    if(outcome == OK){
-        ++n_ok;
-        if(opt_verbosity > 0){ puts(opt_verbosity == 1 ? "OK":"");}
-    }else if(outcome==SKIP){
-        ++n_skipped;
-        if(opt_verbosity > 0){
-            puts("SKIPPED");
-        }
-    }else{
-        ++n_bad;
+// ---
+int mtsuite_async_after(double seconds, TAsyncTimerFn_t fn, void *arg){
+    struct AsyncTest *at = _state()->async;
+    struct AsyncWait *w;
+    if(!at){
+        errno = EINVAL;
+        return -1;
     }
-
-    return (int)outcome;
+    w = _async_add(at, ASYNC_TIMER, -1, 0, _monotonic_now() + seconds);
+    if(!w){ return -1; }
+    w->on_timer = fn;
+    w->arg = arg;
+    return 0;
 }
 
-// ---
-int mtsuite_set_flag(
-    struct Testgroup_t *groups, const char *arg, int set, unsigned long flag
-){
+/* Entry point of a spawned child: run just the test called `name` and
+ * report on --result-fd as a forked child would.  Run by hand, without
+ * --result-fd, the exit status alone tells the outcome. */
+static void _run_single(Testgroup_t *groups, const char *name){
+    struct TestResult res;
+    enum Outcome outcome;
+    Testgroup_t *group = NULL;
+    Testcase_t *tcase = NULL;
     int i, j;
-    size_t len = MTSUITE_MAX_NAMELEN;
-    char fullname[MTSUITE_MAX_NAMELEN];
-    int found = 0;
-    if(strstr(arg, "..")){
-        len = strstr(arg, "..") - arg;
-    }
-    for(i=0; groups[i].prefix; ++i){
-        for(j=0; groups[i].cases[j].name; ++j){
-            Testcase_t *tcase = &groups[i].cases[j];
-            snprintf(
-                fullname, sizeof(fullname), "%s%s",
-                groups[i].prefix, tcase->name
-            );
-            if(!flag){
-                printf("    %s ", fullname);
-                if(tcase->flags & MTSUITE_OFF_BY_DEFAULT){
-                    puts("   (Off by default)");
-                }else if(tcase->flags & MTSUITE_SKIP){
-                    puts("   (DISABLED)");
-                }else{ puts("");}
-            }if(!strncmp(fullname, arg, len)){
-                if(set){tcase->flags |= flag;}
-                else{ tcase->flags &= ~flag; }
-                ++found;
+    /* A scan, not the index: sorting every name per child costs more. */
+    for(i=0; !tcase && groups[i].prefix; ++i){
+        size_t plen = strlen(groups[i].prefix);
+        if(strncmp(name, groups[i].prefix, plen)){ continue; }
+        for(j=0; _has_case(&groups[i], j); ++j){
+            if(!strcmp(name + plen, groups[i].cases[j].name)){
+                group = &groups[i];
+                tcase = &groups[i].cases[j];
+                break;
             }
         }
     }
-
-    return found;
+    if(!tcase){
+        printf("No such test as %s!\n", name);
+        exit(1);
+    }
+    if(_runner()->result_fd >= 0 &&
+            fcntl(_runner()->result_fd, F_GETFD) == -1){
+        printf("--result-fd=%d is not an open descriptor.\n",
+            _runner()->result_fd);
+        exit(1);
+    }
+    _state_enter(group, tcase);
+    _memory_limit(tcase);
+    memset(&res, 0, sizeof(res));
+    ++_runner()->in_mtsuite_main;
+    outcome = _testcase_run_bare(tcase, &res);
+    --_runner()->in_mtsuite_main;
+    fflush(stdout);
+    if(_runner()->result_fd < 0){
+        _fixture_teardown_all();
+        exit(outcome == FAIL ? 1 : 0);
+    }
+    _trace_get(&res);
+    if(_write_report(_runner()->result_fd, outcome, &res)){
+        perror("write outcome to pipe");
+        exit(1);
+    }
+    /* The report is out; the fixture is ours alone to tear down. */
+    close(_runner()->result_fd);
+    _fixture_teardown_all();
+    exit(0);
 }
 
 static void usage(Testgroup_t *groups, int list_groups){
-    puts("Options are: [--verbose|--quiet|--terse]");
+    puts("Options are: [--verbose|--quiet|--terse] [--jobs=N]");
+    puts("  [--isolation=fork|pool|spawn] [--threads=N] [--no-capture]");
+    puts("  [--memory=MIB] [--timeout=SECONDS] [--slowest=K] [--show-times]");
+    puts("  [--bench-time=SECONDS] [--bench-rounds=N] [--bench-warmup=N]");
+    puts("  [--bench-cpus=LIST] [--bench-priority] [--bench-max-cv=PERCENT]");
+    puts("  [--bench-retries=N]");
+    puts("  [--save-baseline=FILE] [--compare-baseline=FILE]");
+    puts("  [--baseline-alpha=P] [--baseline-min-change=PERCENT]");
+    puts("  [--format=jsonl|tap|junit] [--output=FILE] [--tests-from=FILE]");
+    puts("  [--shard=I/N] [--durations=FILE] [--save-durations=FILE]");
+    puts("  [--cache=FILE] [--failed-first] [--rerun-failed] [--heap]");
+    puts("  [--counters] [--trace=FILE] [--arena-size=KIB]"
+        " [--arena-chunk=KIB]");
+    puts("  [--async=N] [--status-file=PATH] [--status-socket=PATH]"
+        " [--status-interval=SECONDS]");
     puts("  Specify tests by name, or using a prefix ending with '..'");
     puts("  To skip a test, prefix its name with a colon.");
     puts("  To enable a disabled test, prefix its name with a plus.");
+    puts("  --tests-from=FILE reads more such names, one per line.");
+    puts("  Use --jobs=N (or -jN) to run N tests at once in forked children;");
+    puts("  --jobs=0 uses one job per online CPU.");
+    puts("  --isolation=pool runs the tests in --jobs long-lived forked");
+    puts("  workers instead of forking once per test; a worker that crashes");
+    puts("  fails only the test it was running and is replaced.");
+    puts("  --isolation=spawn starts each such child as a fresh copy of the");
+    puts("  program (argv[0] --run-single=NAME) with posix_spawn instead of");
+    puts("  fork, which is cheaper for big programs and safe with threads.");
+    puts("  Use --threads=N to run tests on N threads in this process first");
+    puts("  (--threads=0: one per online CPU).  MTSUITE_FORK tests, tests");
+    puts("  with a deadline, benchmarks and tests that declare resources");
+    puts("  still run as otherwise chosen.  A test's .cpus is how many of");
+    puts("  the -j slots it takes, .exclusive ones run alone, and");
+    puts("  .max_memory caps the address space of the child it runs in;");
+    puts("  the caps of the tests running at once add up to no more than");
+    puts("  --memory=MIB (default, and 0: the machine's physical memory).");
+    puts("  A test's output is only shown if it fails (or with --verbose);");
+    puts("  --no-capture lets it through as it happens.  Tests on --threads");
+    puts("  workers only have what they print through mtsuite captured.");
+    puts("  Async tests (.async) run first, up to --async=N (default 64) at");
+    puts("  a time on one event loop in this process, unless they must fork;");
+    puts("  like --threads workers, only what they print through mtsuite is");
+    puts("  captured.  No other test starts until they are all done.  The");
+    puts("  loop keeps their deadlines, so it cannot stop one that blocks;");
+    puts("  make an async test that may hang MTSUITE_FORK.");
+    puts("  --status-file=PATH keeps a JSON snapshot of the run's progress");
+    puts("  in PATH, rewritten every --status-interval seconds (default 1):");
+    puts("  counts, tests per second, ETA from recorded durations, and the");
+    puts("  tests running with how long they have been at it.  Intervals");
+    puts("  under 0.01 are raised to it.");
+    puts("  --status-socket=PATH serves the same snapshot to every client");
+    puts("  that connects to the Unix socket PATH, replacing a socket left");
+    puts("  there but nothing else.");
+    puts("  Use --timeout=SECONDS to kill and report tests that run longer;");
+    puts("  tests with a deadline run in a forked child, except async ones.");
+    puts("  Use --slowest=K to list the K slowest tests with their setup,");
+    puts("  callback and cleanup times and resource usage at the end.");
+    puts("  Use --show-times to print each test's duration.");
+    puts("  Benchmarks run only when selected by name or alias.  Each one");
+    puts("  calibrates its iteration count to --bench-time per round, then");
+    puts("  runs --bench-warmup unmeasured and --bench-rounds measured");
+    puts("  rounds.");
+    puts("  --bench-cpus=LIST (e.g. 2 or 0-3,6) pins benchmarks to those");
+    puts("  CPUs; --bench-priority raises their priority as far as allowed.");
+    puts("  A measurement whose rounds vary by more than --bench-max-cv (5%),");
+    puts("  that changed CPU or that was preempted more than once a round is");
+    puts("  made again, up to --bench-retries (2) times, and flagged NOISY");
+    puts("  if it never settles; a noisy one is not saved or compared.");
+    puts("  --save-baseline stores every benchmark's samples; with");
+    puts("  --compare-baseline each benchmark is checked against the stored");
+    puts("  samples with a Mann-Whitney U test and reported as improved,");
+    puts("  unchanged or regressed.  A change counts when p < alpha (0.01)");
+    puts("  and the median moved by at least min-change (1%).  Any");
+    puts("  regression makes the run fail.");
+    puts("  --format writes one machine-readable record per test to --output");
+    puts("  as tests finish (jsonl by default when only --output is given).");
+    puts("  Without --output the records go to stdout and the usual output");
+    puts("  to stderr.");
+    puts("  --shard=I/N runs only the I-th (from 1) of N disjoint parts of");
+    puts("  the selected tests.  With --durations (as written by");
+    puts("  --save-durations) the parts are balanced by recorded time.");
+    puts("  --cache=FILE keeps each test's last outcome and time in FILE.");
+    puts("  --failed-first runs the tests that failed last time first;");
+    puts("  --rerun-failed runs only those.  Without --cache, these two keep");
+    puts("  the cache in " MTSUITE_CACHE_FILE "PROGRAM.");
+    puts("  --heap counts each test's allocations, bytes, peak and leaked");
+    puts("  bytes from setup through cleanup, and fails tests that go over");
+    puts("  their max_allocs or max_heap or leak more than max_leak.  Left");
+    puts("  at 0 these set no limit; MTSUITE_NONE allows nothing at all.");
+    puts("  It needs the program linked with mtsuite_heap, which replaces");
+    puts("  the allocator's entry points with counting ones.");
+    puts("  --counters reads cycles, instructions, branch and cache misses");
+    puts("  around each callback (per iteration for benchmarks), or only");
+    puts("  software events where the kernel does not allow hardware ones.");
+    puts("  mtsuite_arena_alloc() gives a test scratch memory that is all");
+    puts("  taken back after its cleanup and reused by the next test; the");
+    puts("  arena starts at --arena-size KiB (default 64) and grows by");
+    puts("  chunks of at least --arena-chunk KiB (default 64).");
+    puts("  --trace=FILE writes a Chrome/Perfetto trace of the run: a span");
+    puts("  per test with its setup, callback and cleanup, one track per");
+    puts("  worker, fork/wait/report overhead and mtsuite_trace_begin()");
+    puts("  spans.");
     puts("  Use --list-test for a list of tests.");
     if(list_groups){
         puts("Known tests are:");
         mtsuite_set_flag(groups, "..", 1, 0);
     }
-    exit(0);
 }
 
 
 static int process_test_alias(Testgroup_t *groups, const char *test){
+    const TestlistAlias_t *aliases = _runner()->aliases;
     int i, j, n, r;
-    for(i=0; cfg_aliases && cfg_aliases[i].name; ++i){
-        if(!strcmp(cfg_aliases[i].name, test)){
+    for(i=0; aliases && aliases[i].name; ++i){
+        if(!strcmp(aliases[i].name, test)){
             n = 0;
-            for(j=0; cfg_aliases[i].tests[j]; ++j){
-                r = process_test_option(groups, cfg_aliases[i].tests[j]);
+            for(j=0; aliases[i].tests[j]; ++j){
+                r = process_test_option(groups, aliases[i].tests[j]);
                 if(r < 0){ return -1; }
                 n += r;
             }
@@ -244,89 +5255,877 @@ static int process_test_option(Testgroup_t *groups, const char *test){
     return n;
 }
 
+/* Process one test option per line of `fname`; blank lines and lines
+ * starting with '#' are ignored. */
+static int process_tests_file(Testgroup_t *groups, const char *fname){
+    FILE *f = fopen(fname, "re");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int n = 0, r = 0;
+    if(!f){
+        perror(fname);
+        return -1;
+    }
+    while((len = getline(&line, &cap, f)) != -1){
+        char *start = line;
+        while(len && (line[len-1] == '\n' || line[len-1] == '\r' ||
+                line[len-1] == ' ' || line[len-1] == '\t')){
+            line[--len] = 0;
+        }
+        while(*start == ' ' || *start == '\t'){ ++start; }
+        if(!*start || *start == '#'){ continue; }
+        if((r = process_test_option(groups, start)) < 0){ break; }
+        n += r;
+    }
+    free(line);
+    fclose(f);
+    return r < 0 ? -1 : n;
+}
+
 //
 void mtsuite_set_aliases(const struct TestlistAlias_t *aliases){
     cfg_aliases = aliases;
 }
 
-// 
-int mtsuite_main(int argc, char **argv, struct Testgroup_t *groups){
-    int i, j, n = 0;
-    for(i=1; i < argc; ++i){
-        if(argv[i][0] == '-'){
-            if(!strcmp(argv[i], "--quiet")){
-                opt_verbosity = -1;
-                verbosity_flag = "--quiet";
-            }else if(!strcmp(argv[i], "--verbose")){
-                opt_verbosity = 2;
-                verbosity_flag = "--verbose";
-            }else if(!strcmp(argv[i], "--terse")){
-                opt_verbosity = 0;
-                verbosity_flag = "--terse";
-            }else if(!strcmp(argv[i], "--help")){
-                usage(groups, 0);
-            }else{
-                printf("Unknown option %s. Try --help\n", argv[i]);
-                return -1;
-            }
-        }else{
-            int r = process_test_option(groups, argv[i]);
-            if(r < 0){ return -1; }
-            n += r;
+/* Parse the value of "--option=VALUE" at argv[off] into a non-negative
+ * number. */
+static int _parse_double(const char *arg, int off, double *out){
+    char *endp;
+    double v = strtod(arg + off, &endp);
+    if(*endp || endp == arg + off || !isfinite(v) || v < 0){
+        printf("Bad value in %s. Try --help\n", arg);
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int _parse_count(const char *arg, int off, long min, int *out){
+    char *endp;
+    long v = strtol(arg + off, &endp, 10);
+    if(*endp || endp == arg + off || v < min || v > INT_MAX){
+        printf("Bad value in %s. Try --help\n", arg);
+        return -1;
+    }
+    *out = (int)v;
+    return 0;
+}
+
+/* The cases MTSUITE_TEST put in the mtsuite_tests section, bounded by
+ * symbols the linker defines; both are NULL if there are none. */
+extern Testcase_t __start_mtsuite_tests[] __attribute__((weak));
+extern Testcase_t __stop_mtsuite_tests[] __attribute__((weak));
+
+static void _runner_init(Testrunner_t *run){
+    memset(run, 0, sizeof(*run));
+    run->result = -1;
+    run->opt_verbosity = 1;
+    run->verbosity_flag = "";
+    run->opt_capture = 1;
+    run->opt_isolation = ISOLATE_FORK;
+    run->opt_bench_time = 0.1;
+    run->opt_bench_rounds = 10;
+    run->opt_bench_warmup = 2;
+    run->opt_bench_max_cv = 5;
+    run->opt_bench_retries = 2;
+    run->opt_baseline_alpha = 0.01;
+    run->opt_baseline_min_change = 1;
+    run->opt_arena_size = 64;
+    run->opt_arena_chunk = 64;
+    run->opt_async = 64;
+    run->opt_status_interval = 1;
+    run->cache_fd = -1;
+    run->result_fd = -1;
+    run->status_fallback = 1;
+    run->status_sock = -1;
+    run->status_wake[0] = run->status_wake[1] = -1;
+    run->worker_fds[0] = run->worker_fds[1] = -1;
+    run->capture_fds[0] = run->capture_fds[1] = -1;
+    run->saved_fds[0] = run->saved_fds[1] = -1;
+    run->main_state.outcome = OK;
+    pthread_mutex_init(&run->main_state.lock, NULL);
+    pthread_mutex_init(&run->fixture_lock, NULL);
+    pthread_mutex_init(&run->status_lock, NULL);
+    pthread_mutex_init(&run->count_lock, NULL);
+}
+
+/* Give `run` its own copy of `groups` (which may be NULL), and of every
+ * registered case as one more group with an empty prefix, so that what
+ * selection marks is nobody else's.  Each copied group knows its size and
+ * still ends at an empty case. */
+static int _runner_copy_groups(Testrunner_t *run, const Testgroup_t *groups){
+    size_t n_groups = 0, n_cases = 0, n_reg = 0, i, j, k = 0;
+    Testgroup_t *copy;
+    Testcase_t *cases;
+    if(__start_mtsuite_tests){
+        n_reg = __stop_mtsuite_tests - __start_mtsuite_tests;
+    }
+    for(; groups && groups[n_groups].prefix; ++n_groups){
+        for(j=0; _has_case(&groups[n_groups], j); ++j){ ++n_cases; }
+    }
+    copy = calloc(n_groups + 2, sizeof(*copy));
+    cases = calloc(n_cases + n_groups + n_reg + 1, sizeof(*cases));
+    if(!copy || !cases){
+        perror("copying tests");
+        free(copy);
+        free(cases);
+        return -1;
+    }
+    for(i=0; i < n_groups; ++i){
+        copy[i] = groups[i];
+        copy[i].cases = cases + k;
+        for(j=0; _has_case(&groups[i], j); ++j){
+            cases[k++] = groups[i].cases[j];
+        }
+        copy[i].n_cases = j;
+        ++k;
+    }
+    if(n_reg){
+        copy[i].prefix = "";
+        copy[i].cases = cases + k;
+        copy[i].n_cases = n_reg;
+        memcpy(cases + k, __start_mtsuite_tests, n_reg * sizeof(*cases));
+    }
+    run->groups = copy;
+    run->cases = cases;
+    return 0;
+}
+
+Testrunner_t *mtsuite_runner_new(struct Testgroup_t *groups){
+    Testrunner_t *run = malloc(sizeof(*run));
+    if(!run){ return NULL; }
+    _runner_init(run);
+    run->aliases = cfg_aliases;
+    if(_runner_copy_groups(run, groups)){
+        mtsuite_runner_free(run);
+        return NULL;
+    }
+    return run;
+}
+
+void mtsuite_runner_set_aliases(
+    Testrunner_t *run, const struct TestlistAlias_t *aliases
+){
+    run->aliases = aliases;
+}
+
+static int _runner_option(Testrunner_t *run, const char *arg){
+    if(arg[0] != '-'){
+        printf("Unknown option %s. Try --help\n", arg);
+        return -1;
+    }
+    if(!strcmp(arg, "--quiet")){
+        run->opt_verbosity = -1;
+        run->verbosity_flag = "--quiet";
+    }else if(!strcmp(arg, "--verbose")){
+        run->opt_verbosity = 2;
+        run->verbosity_flag = "--verbose";
+    }else if(!strcmp(arg, "--terse")){
+        run->opt_verbosity = 0;
+        run->verbosity_flag = "--terse";
+    }else if(!strncmp(arg, "--jobs=", 7) ||
+            (arg[1] == 'j' && arg[2])){
+        const char *val = arg + (arg[1] == 'j' ? 2 : 7);
+        char *endp;
+        long jobs = strtol(val, &endp, 10);
+        if(*endp || jobs < 0){
+            printf("Bad job count %s. Try --help\n", val);
+            return -1;
+        }
+        if(!jobs){ jobs = sysconf(_SC_NPROCESSORS_ONLN); }
+        run->opt_jobs = jobs > 0 ? (int)jobs : 1;
+    }else if(!strncmp(arg, "--memory=", 9)){
+        int mib;
+        if(_parse_count(arg, 9, 0, &mib)){ return -1; }
+        run->opt_memory = (unsigned long)mib <= ULONG_MAX >> 20 ?
+            (unsigned long)mib << 20 : ULONG_MAX;
+    }else if(!strncmp(arg, "--threads=", 10)){
+        if(_parse_count(arg, 10, 0, &run->opt_threads)){ return -1; }
+        if(!run->opt_threads){
+            long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+            run->opt_threads = ncpu > 0 ? (int)ncpu : 1;
+        }
+    }else if(!strcmp(arg, "--isolation=fork")){
+        run->opt_isolation = ISOLATE_FORK;
+    }else if(!strcmp(arg, "--isolation=pool")){
+        run->opt_isolation = ISOLATE_POOL;
+    }else if(!strcmp(arg, "--isolation=spawn")){
+        run->opt_isolation = ISOLATE_SPAWN;
+    }else if(!strncmp(arg, "--run-single=", 13)){
+        if(_option_copy(&run->run_single, arg + 13)){ return -1; }
+    }else if(!strncmp(arg, "--result-fd=", 12)){
+        if(_parse_count(arg, 12, 0, &run->result_fd)){ return -1; }
+    }else if(!strncmp(arg, "--timeout=", 10)){
+        if(_parse_double(arg, 10, &run->opt_timeout)){ return -1; }
+    }else if(!strncmp(arg, "--slowest=", 10)){
+        if(_parse_count(arg, 10, 0, &run->opt_slowest)){ return -1; }
+    }else if(!strncmp(arg, "--bench-time=", 13)){
+        if(_parse_double(arg, 13, &run->opt_bench_time)){ return -1; }
+    }else if(!strncmp(arg, "--bench-rounds=", 15)){
+        if(_parse_count(arg, 15, 1, &run->opt_bench_rounds)){
+            return -1;
+        }
+    }else if(!strncmp(arg, "--bench-warmup=", 15)){
+        if(_parse_count(arg, 15, 0, &run->opt_bench_warmup)){
+            return -1;
+        }
+    }else if(!strncmp(arg, "--bench-cpus=", 13)){
+        if(_bench_parse_cpus(arg, arg + 13)){ return -1; }
+    }else if(!strcmp(arg, "--bench-priority")){
+        run->opt_bench_priority = 1;
+    }else if(!strncmp(arg, "--bench-max-cv=", 15)){
+        if(_parse_double(arg, 15, &run->opt_bench_max_cv)){
+            return -1;
+        }
+    }else if(!strncmp(arg, "--bench-retries=", 16)){
+        if(_parse_count(arg, 16, 0, &run->opt_bench_retries)){
+            return -1;
+        }
+    }else if(!strncmp(arg, "--save-baseline=", 16)){
+        /* Opened once every option is in, so that --compare-baseline may
+         * read the same file first. */
+        if(_option_copy(&run->baseline_fname, arg + 16)){ return -1; }
+    }else if(!strncmp(arg, "--compare-baseline=", 19)){
+        if(_baseline_load(arg + 19)){ return -1; }
+    }else if(!strncmp(arg, "--baseline-alpha=", 17)){
+        if(_parse_double(arg, 17, &run->opt_baseline_alpha)){
+            return -1;
+        }
+    }else if(!strncmp(arg, "--baseline-min-change=", 22)){
+        if(_parse_double(arg, 22, &run->opt_baseline_min_change)){
+            return -1;
+        }
+    }else if(!strncmp(arg, "--format=", 9)){
+        if(_reporter_select(arg + 9)){ return -1; }
+    }else if(!strncmp(arg, "--output=", 9)){
+        if(_option_copy(&run->report_fname, arg + 9)){ return -1; }
+    }else if(!strncmp(arg, "--tests-from=", 13)){
+        int r = process_tests_file(run->groups, arg + 13);
+        if(r < 0){ return -1; }
+        run->n_selected += r;
+    }else if(!strncmp(arg, "--shard=", 8)){
+        char *endp;
+        long shard = strtol(arg + 8, &endp, 10), shards = 0;
+        if(*endp == '/'){ shards = strtol(endp + 1, &endp, 10); }
+        if(*endp || shards < 1 || shards > INT_MAX ||
+                shard < 1 || shard > shards){
+            printf("Bad value in %s. Try --help\n", arg);
+            return -1;
+        }
+        run->opt_shard = (int)shard;
+        run->opt_shards = (int)shards;
+    }else if(!strncmp(arg, "--durations=", 12)){
+        if(_durations_load(arg + 12)){ return -1; }
+    }else if(!strncmp(arg, "--save-durations=", 17)){
+        /* Opened once the run starts, so that --durations may read the
+         * same file first. */
+        if(_option_copy(&run->durations_fname, arg + 17)){ return -1; }
+    }else if(!strncmp(arg, "--cache=", 8)){
+        if(_option_copy(&run->cache_fname, arg + 8)){ return -1; }
+    }else if(!strcmp(arg, "--failed-first")){
+        run->opt_failed_first = 1;
+    }else if(!strcmp(arg, "--rerun-failed")){
+        run->opt_rerun_failed = 1;
+    }else if(!strncmp(arg, "--trace=", 8)){
+        /* An empty FILE, as spawned children get, records only. */
+        run->opt_trace = 1;
+        free(run->trace_fname);
+        run->trace_fname = NULL;
+        if(arg[8] && _option_copy(&run->trace_fname, arg + 8)){ return -1; }
+    }else if(!strncmp(arg, "--arena-size=", 13)){
+        if(_parse_count(arg, 13, 1, &run->opt_arena_size)){
+            return -1;
+        }
+    }else if(!strncmp(arg, "--arena-chunk=", 14)){
+        if(_parse_count(arg, 14, 1, &run->opt_arena_chunk)){
+            return -1;
+        }
+    }else if(!strncmp(arg, "--status-file=", 14)){
+        if(_option_copy(&run->status_fname, arg + 14)){ return -1; }
+    }else if(!strncmp(arg, "--status-socket=", 16)){
+        if(_option_copy(&run->status_sockname, arg + 16)){ return -1; }
+    }else if(!strncmp(arg, "--status-interval=", 18)){
+        if(_parse_double(arg, 18, &run->opt_status_interval)){ return -1; }
+        if(!run->opt_status_interval){
+            printf("Bad value in %s. Try --help\n", arg);
+            return -1;
+        }
+        /* Anything shorter would keep the status thread rewriting. */
+        if(run->opt_status_interval < MTSUITE_MIN_STATUS_INTERVAL){
+            run->opt_status_interval = MTSUITE_MIN_STATUS_INTERVAL;
+        }
+    }else if(!strncmp(arg, "--async=", 8)){
+        if(_parse_count(arg, 8, 1, &run->opt_async)){ return -1; }
+    }else if(!strcmp(arg, "--counters")){
+        run->opt_counters = 1;
+    }else if(!strcmp(arg, "--heap")){
+#ifdef MTSUITE_HEAP_HOOKS
+        run->opt_heap = &mtsuite_heap_hooks != NULL;
+#endif
+        if(!run->opt_heap){
+            puts("Heap accounting needs the program linked with mtsuite_heap.");
+        }
+    }else if(!strcmp(arg, "--no-capture")){
+        run->opt_capture = 0;
+    }else if(!strcmp(arg, "--show-times")){
+        run->opt_show_times = 1;
+    }else if(!strcmp(arg, "--help")){
+        usage(run->groups, 0);
+        run->finished = 1;
+        run->result = 0;
+    }else{
+        printf("Unknown option %s. Try --help\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+int mtsuite_runner_option(Testrunner_t *run, const char *option){
+    Testrunner_t *prev = cur_runner;
+    int r;
+    cur_runner = run;
+    r = _runner_option(run, option);
+    cur_runner = prev;
+    return r;
+}
+
+int mtsuite_runner_select(Testrunner_t *run, const char *test){
+    Testrunner_t *prev = cur_runner;
+    int r;
+    cur_runner = run;
+    r = process_test_option(run->groups, test);
+    cur_runner = prev;
+    if(r < 0){ return -1; }
+    run->n_selected += r;
+    return 0;
+}
+
+/* `run` starts (add) or stops running tests. */
+static void _runner_running(Testrunner_t *run, int add){
+    if(run->owns_process){ main_runner = add ? run : NULL; }
+    if(run->opt_heap){ mtsuite_heap_runners += add ? 1 : -1; }
+}
+
+int mtsuite_runner_run(Testrunner_t *run){
+    Testrunner_t *prev_runner = cur_runner;
+    struct TestState *prev_state = cur_state;
+    Testgroup_t *groups = run->groups;
+    struct PlanEntry *plan = NULL;
+    int n_plan = 0, i, j;
+    if(run->finished){ return run->result; }
+    run->finished = 1;
+    /* A test may run a suite of its own: that one reports to itself. */
+    cur_runner = run;
+    cur_state = NULL;
+    run->trace_t0 = _monotonic_now();
+    for(run->n_fixtures=0; groups[run->n_fixtures].prefix; ++run->n_fixtures)
+        ;
+    if(run->n_fixtures && !(run->fixtures =
+            calloc(run->n_fixtures, sizeof(*run->fixtures)))){
+        perror("allocating group fixtures");
+        goto done;
+    }
+    run->fixture_groups = groups;
+    if(run->run_single || (run->opt_isolation == ISOLATE_SPAWN &&
+            !run->self_exe)){
+        if(!run->owns_process){
+            printf("%s needs the program to run mtsuite_main.\n",
+                run->run_single ? "--run-single" : "--isolation=spawn");
+            goto done;
         }
     }
-    if(!n){
+    if(run->run_single){
+        _run_single(groups, run->run_single);
+    }
+    if(!run->n_selected){
         mtsuite_set_flag(groups, "..", 1, MTSUITE_ENABLED);
+        /* Benchmarks only run when asked for by name or alias. */
+        for(i=0; groups[i].prefix; ++i){
+            for(j=0; _has_case(&groups[i], j); ++j){
+                if(groups[i].cases[j].bench){
+                    groups[i].cases[j].flags &= ~MTSUITE_ENABLED;
+                }
+            }
+        }
+    }
+
+    if(run->report_fname && !run->reporter){
+        run->reporter = &reporters[0];
+    }
+    if(run->reporter && _reporter_open(run->report_fname)){
+        goto done;
+    }
+    if(run->baseline_fname && _baseline_open_output(run->baseline_fname)){
+        goto done;
+    }
+    if(run->durations_fname &&
+            !(run->durations_out = fopen(run->durations_fname, "we"))){
+        perror(run->durations_fname);
+        goto done;
+    }
+    if(run->opt_counters){
+        /* Find out now what children and threads will be able to count. */
+        _counters_open(&run->main_state);
+        if(run->main_state.perf_mode != COUNTERS_HARDWARE &&
+                run->opt_verbosity >= 0){
+            printf("Hardware counters unavailable (%s); %s.\n",
+                strerror(run->counters_errno),
+                run->main_state.perf_mode == COUNTERS_SOFTWARE ?
+                "counting software events only" : "not counting");
+        }
     }
 
 #ifdef _IONBF
-    setvbuf(stdout, NULL, _IOFBF, 0);
+    if(run->owns_process){ setvbuf(stdout, NULL, _IOFBF, 0); }
 #endif
 
-    ++in_mtsuite_main;
     for(i=0; groups[i].prefix; ++i){
-        for(j=0; groups[i].cases[j].flags; ++j){
+        for(j=0; _has_case(&groups[i], j); ++j){
+            if(groups[i].cases[j].flags & MTSUITE_ENABLED){ ++n_plan; }
+        }
+    }
+    if(n_plan && !(plan = calloc(n_plan, sizeof(*plan)))){
+        perror("allocating test plan");
+        goto done;
+    }
+    n_plan = 0;
+    for(i=0; groups[i].prefix; ++i){
+        for(j=0; _has_case(&groups[i], j); ++j){
             if(groups[i].cases[j].flags & MTSUITE_ENABLED){
-                mtsuite_run_one(&groups[i], &groups[i].cases[j]);
+                plan[n_plan].group = &groups[i];
+                plan[n_plan].tcase = &groups[i].cases[j];
+                ++n_plan;
             }
         }
     }
 
-    --in_mtsuite_main;
-    if(opt_verbosity==0){ puts(""); }
-    if(n_bad){
+    if(run->opt_shards && (n_plan = _shard_plan(plan, n_plan)) < 0){
+        goto done;
+    }
+    if(!run->cache_fname && run->self_argv0 &&
+            (run->opt_failed_first || run->opt_rerun_failed)){
+        const char *base = strrchr(run->self_argv0, '/');
+        char cache_fname[MTSUITE_MAX_NAMELEN];
+        /* One cache per program, so that test programs run side by side
+         * in one directory keep theirs apart. */
+        snprintf(cache_fname, sizeof(cache_fname), "%s%s",
+            MTSUITE_CACHE_FILE, base ? base + 1 : run->self_argv0);
+        if(_option_copy(&run->cache_fname, cache_fname)){ goto done; }
+    }
+    if(run->cache_fname && *run->cache_fname){
+        if(_cache_load()){ goto done; }
+        if((run->opt_failed_first || run->opt_rerun_failed) &&
+                (n_plan = _cache_order(plan, n_plan)) < 0){
+            goto done;
+        }
+        _cache_open();
+    }
+    for(i=0; i < n_plan; ++i){
+        if(!(plan[i].tcase->flags & (MTSUITE_SKIP|MTSUITE_OFF_BY_DEFAULT))){
+            ++run->fixtures[plan[i].group - groups].remaining;
+        }
+    }
+
+    ++run->in_mtsuite_main;
+    _runner_running(run, 1);
+    if(run->opt_isolation == ISOLATE_POOL && !run->opt_jobs){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        run->opt_jobs = ncpu > 0 ? (int)ncpu : 1;
+    }
+    if(!run->opt_memory){ run->opt_memory = _physical_memory(); }
+    _status_open(plan, n_plan,
+        1 + run->opt_threads + run->opt_jobs + run->opt_async);
+    n_plan = _run_async(plan, n_plan);
+    if(run->opt_threads){
+        n_plan = _run_threads(plan, n_plan);
+    }
+    if(run->opt_isolation == ISOLATE_POOL){
+        _run_pool(plan, n_plan);
+    }else if(run->opt_jobs){
+        _run_parallel(plan, n_plan);
+    }else{
+        for(i=0; i < n_plan && !run->broken; ++i){
+            mtsuite_run_one(plan[i].group, plan[i].tcase);
+        }
+    }
+
+    _runner_running(run, 0);
+    --run->in_mtsuite_main;
+    _status_close();
+    _counters_close(&run->main_state);
+    _fixture_teardown_all();
+    _reporter_close();
+    _trace_write();
+    if(run->opt_verbosity==0){ puts(""); }
+    _print_slowest();
+    if(run->baseline_out){
+        if(fclose(run->baseline_out)){ perror("writing baseline"); }
+        run->baseline_out = NULL;
+    }
+    if(run->durations_out){
+        if(fclose(run->durations_out)){ perror("writing durations"); }
+        run->durations_out = NULL;
+    }
+    _cache_close();
+    if(run->n_regressed){
+        printf("%d BENCHMARKS REGRESSED.\n", run->n_regressed);
+    }
+    if(run->n_bad && run->n_timeout){
+        printf(
+            "%d/%d TESTS FAILED. (%d skipped, %d timed out)\n", run->n_bad,
+            run->n_bad+run->n_ok, run->n_skipped, run->n_timeout
+        );
+    }else if(run->n_bad){
         printf(
-            "%d/%d TESTS FAILED. (%d skipped)\n", n_bad,
-            n_bad+n_ok, n_skipped
+            "%d/%d TESTS FAILED. (%d skipped)\n", run->n_bad,
+            run->n_bad+run->n_ok, run->n_skipped
         );
-    }else if(opt_verbosity >= 1){
-        printf("%d tests ok. (%d skipped)\n", n_ok, n_skipped);
+    }else if(run->opt_verbosity >= 1){
+        printf("%d tests ok. (%d skipped)\n", run->n_ok, run->n_skipped);
+    }
+    fflush(stdout);
+    if(run->broken){
+        run->result = -1;
+    }else{
+        run->result = (run->n_bad == 0 && run->n_regressed == 0) ? 0 : 1;
+    }
+
+done:
+    free(plan);
+    cur_runner = prev_runner;
+    cur_state = prev_state;
+    return run->result;
+}
+
+const struct TestrunResult_t *mtsuite_runner_results(
+    const Testrunner_t *run, int *n_results
+){
+    *n_results = run->n_results;
+    return run->results;
+}
+
+void mtsuite_runner_free(Testrunner_t *run){
+    Testrunner_t *prev = cur_runner;
+    int i;
+    if(!run){ return; }
+    cur_runner = run;
+    _reporter_close();
+    _cache_close();
+    _index_free();
+    if(run->baseline_out){ fclose(run->baseline_out); }
+    if(run->durations_out){ fclose(run->durations_out); }
+    cur_runner = prev;
+    for(i=0; i < 2; ++i){
+        if(run->capture_fds[i] != -1){ close(run->capture_fds[i]); }
+        if(run->saved_fds[i] != -1){ close(run->saved_fds[i]); }
+    }
+    for(i=0; i < run->n_baseline; ++i){
+        free(run->baseline[i].name);
+        free(run->baseline[i].samples);
+    }
+    free(run->baseline);
+    for(i=0; i < run->n_durations; ++i){ free(run->durations[i].name); }
+    free(run->durations);
+    for(i=0; i < run->n_results; ++i){
+        free((char*)run->results[i].messages);
     }
+    free(run->results);
+    free(run->slowest);
+    free(run->fixtures);
+    free(run->main_state.msg_buf);
+    free(run->main_state.out);
+    free(run->main_state.trace);
+    _arena_free(&run->main_state);
+    runner_free(run->main_state.heap_blocks);
+    pthread_mutex_destroy(&run->main_state.lock);
+    pthread_mutex_destroy(&run->fixture_lock);
+    pthread_mutex_destroy(&run->status_lock);
+    pthread_mutex_destroy(&run->count_lock);
+    free(run->report_fname);
+    free(run->run_single);
+    free(run->opt_bench_cpus);
+    free(run->trace_fname);
+    free(run->status_fname);
+    free(run->status_sockname);
+    free(run->baseline_fname);
+    free(run->durations_fname);
+    free(run->cache_fname);
+    free(run->groups);
+    free(run->cases);
+    free(run);
+}
 
-    return (n_bad == 0) ? 0 : 1;
+// 
+int mtsuite_main(int argc, char **argv, struct Testgroup_t *groups){
+    Testrunner_t *run = mtsuite_runner_new(groups);
+    int i, r = 0;
+    if(!run){ return -1; }
+    run->owns_process = 1;
+    /* Our own image, even if argv[0] was found along $PATH. */
+    run->self_argv0 = argv[0];
+    run->self_exe = access("/proc/self/exe", X_OK) ? argv[0] :
+        "/proc/self/exe";
+    for(i=1; i < argc && !r && !run->finished; ++i){
+        r = argv[i][0] == '-' ? mtsuite_runner_option(run, argv[i]) :
+            mtsuite_runner_select(run, argv[i]);
+    }
+    if(!r){ r = mtsuite_runner_run(run); }
+    mtsuite_runner_free(run);
+    return r;
 }
 
 //
-int mtsuite_get_verbosity(void){ return opt_verbosity; }
+int mtsuite_get_verbosity(void){ return _runner()->opt_verbosity; }
+
+/* Name the running test once, ahead of its first failure, when the
+ * output does not already name each test. */
+static void _name_failed_test(void){
+    struct TestState *st = _state();
+    pthread_mutex_lock(&st->lock);
+    if(_runner()->opt_verbosity <= 0 && st->name){
+        _test_printf(_runner()->opt_verbosity == 0 ? "\n%s%s: " : "%s%s: ",
+            st->prefix, st->name);
+        st->name = NULL;
+    }
+    pthread_mutex_unlock(&st->lock);
+}
 
 // --
 void mtsuite_set_test_failed(void){
-    if(opt_verbosity <= 0 && cur_test_name){
-        if(opt_verbosity==0){ puts("");}
-        printf("%s%s: ", cur_test_prefix, cur_test_name);
-        cur_test_name = NULL;
-    }
-    cur_test_outcome = 0;
+    _name_failed_test();
+    _state()->outcome = FAIL;
 }
 
 // ---
 void mtsuite_set_test_skipped(void){
-    if(cur_test_outcome==OK){cur_test_outcome = SKIP; }
+    int expected = OK;
+    atomic_compare_exchange_strong(&_state()->outcome, &expected, SKIP);
 }
 
 // 
 int mtsuite_cur_test_has_failed(void){
-    return (cur_test_outcome == FAIL);
+    return (_state()->outcome == FAIL);
+}
+
+// ---
+void mtsuite_trace_begin(const char *name){
+    struct TestState *st;
+    if(!_runner()->opt_trace){ return; }
+    st = _state();
+    if(st->trace_depth < MTSUITE_TRACE_DEPTH){
+        /* Copied: the caller's name need not outlive the call. */
+        snprintf(st->trace_names[st->trace_depth], MTSUITE_TRACE_NAMELEN,
+            "%s", name);
+        st->trace_begun[st->trace_depth] = _monotonic_now();
+    }
+    ++st->trace_depth;
+}
+
+// ---
+void mtsuite_trace_end(void){
+    struct TestState *st;
+    if(!_runner()->opt_trace){ return; }
+    st = _state();
+    if(!st->trace_depth){ return; }
+    if(--st->trace_depth < MTSUITE_TRACE_DEPTH){
+        _trace_span(TRACE_USER, st->trace_names[st->trace_depth],
+            st->trace_begun[st->trace_depth], _monotonic_now());
+    }
+}
+
+// ---
+void *mtsuite_arena_alloc(size_t size){
+    struct TestState *st = _state();
+    struct ArenaChunk *c = st->arena_cur;
+    size_t need = (size + sizeof(max_align_t) - 1) &
+        ~(sizeof(max_align_t) - 1);
+    /* A thread the test started shares no state of its own: no lock guards
+     * the arena it would fall back on. */
+    if(!cur_runner){ return NULL; }
+    /* Rounding up wrapped around, or no chunk could hold it. */
+    if(need < size || need > SIZE_MAX - sizeof(struct ArenaChunk)){
+        return NULL;
+    }
+    while(!c || c->size - st->arena_used < need){
+        if(c && c->next){
+            /* Left by an earlier test; too small ones are skipped. */
+            c = c->next;
+        }else{
+            size_t cap = (size_t)(c ? _runner()->opt_arena_chunk :
+                _runner()->opt_arena_size) * 1024;
+            struct ArenaChunk *nc;
+            if(cap < need){ cap = need; }
+            if(!(nc = runner_realloc(NULL, sizeof(*nc) + cap))){
+                return NULL;
+            }
+            nc->next = NULL;
+            nc->size = cap;
+            if(c){
+                c->next = nc;
+            }else{
+                st->arena_head = nc;
+            }
+            c = nc;
+        }
+        st->arena_cur = c;
+        st->arena_used = 0;
+    }
+    st->arena_used += need;
+    return (char*)c->data + st->arena_used - need;
+}
+
+// ---
+char *mtsuite_arena_strdup(const char *s){
+    size_t len = strlen(s) + 1;
+    char *copy = mtsuite_arena_alloc(len);
+    if(copy){ memcpy(copy, s, len); }
+    return copy;
+}
+
+// ---
+void *mtsuite_group_fixture(void){
+    struct GroupFixture *f = _fixture_of(_state()->group);
+    return f && f->tried && f->built == OK ? f->env : NULL;
+}
+
+/* Offset of the first byte where `a` and `b` differ, or `len` if none
+ * does.  Compares 64 bytes at a time with SSE2, else a word at a time. */
+static size_t _first_diff(const void *a_, const void *b_, size_t len){
+    const unsigned char *a = a_, *b = b_;
+    size_t i = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+    for(; i + 64 <= len; i += 64){
+        __m128i eq = _mm_and_si128(
+            _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                    _mm_loadu_si128((const __m128i*)(b + i))),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)),
+                    _mm_loadu_si128((const __m128i*)(b + i + 16)))),
+            _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 32)),
+                    _mm_loadu_si128((const __m128i*)(b + i + 32))),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 48)),
+                    _mm_loadu_si128((const __m128i*)(b + i + 48)))));
+        if(_mm_movemask_epi8(eq) != 0xffff){ break; }
+    }
+    for(; i + 16 <= len; i += 16){
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i*)(a + i)),
+            _mm_loadu_si128((const __m128i*)(b + i))));
+        if(mask != 0xffff){ return i + __builtin_ctz(~mask); }
+    }
+#endif
+    for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)){
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if(x != y){ break; }
+    }
+    for(; i < len && a[i] == b[i]; ++i)
+        ;
+    return i;
+}
+
+/* Append to the `size`-byte `buf` holding `*len` bytes, truncating. */
+static void _diff_printf(char *buf, size_t size, size_t *len,
+        const char *fmt, ...){
+    va_list ap;
+    int n;
+    if(*len + 1 >= size){ return; }
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if(n > 0){ *len = *len + n < size ? *len + n : size - 1; }
+}
+
+/* Bytes per hexdump row, and rows shown on each side of the first
+ * difference. */
+#define MTSUITE_DIFF_ROW        8
+#define MTSUITE_DIFF_CONTEXT    2
+
+// ---
+char* mtsuite_format_mem_diff(
+    char *buf, unsigned long size, const void *a, const void *b,
+    unsigned long len
+){
+    const unsigned char *x = a, *y = b;
+    size_t n = 0, d, row, first, last, i, j;
+    if(!size){ return buf; }
+    buf[0] = 0;
+    if(!a || !b){
+        _diff_printf(buf, size, &n, "%s vs %s", a ? "<buffer>" : "null",
+            b ? "<buffer>" : "null");
+        return buf;
+    }
+    if((d = _first_diff(a, b, len)) == len){
+        _diff_printf(buf, size, &n, "all %lu bytes equal", len);
+        return buf;
+    }
+    _diff_printf(buf, size, &n, "first difference at offset %lu of %lu",
+        (unsigned long)d, len);
+    row = d / MTSUITE_DIFF_ROW;
+    first = row > MTSUITE_DIFF_CONTEXT ? row - MTSUITE_DIFF_CONTEXT : 0;
+    last = row + MTSUITE_DIFF_CONTEXT;
+    if(last > (len - 1) / MTSUITE_DIFF_ROW){
+        last = (len - 1) / MTSUITE_DIFF_ROW;
+    }
+    for(row=first; row <= last; ++row){
+        size_t off = row * MTSUITE_DIFF_ROW;
+        int differs = 0;
+        _diff_printf(buf, size, &n, "\n    %08lx ", (unsigned long)off);
+        for(i=0; i < 2; ++i){
+            const unsigned char *p = i ? y : x;
+            if(i){ _diff_printf(buf, size, &n, "  |"); }
+            for(j=off; j < off + MTSUITE_DIFF_ROW; ++j){
+                if(j < len){
+                    _diff_printf(buf, size, &n, " %02x", p[j]);
+                    differs |= x[j] != y[j];
+                }else{
+                    _diff_printf(buf, size, &n, "   ");
+                }
+            }
+        }
+        if(differs){ _diff_printf(buf, size, &n, "  <"); }
+    }
+    return buf;
+}
+
+/* Characters of each string shown on either side of the first
+ * difference. */
+#define MTSUITE_DIFF_CHARS      24
+
+// ---
+char* mtsuite_format_str_diff(
+    char *buf, unsigned long size, const char *a, const char *b
+){
+    size_t n = 0, la, lb, d, start, i;
+    if(!size){ return buf; }
+    buf[0] = 0;
+    if(!a || !b){
+        _diff_printf(buf, size, &n, "<%s> vs <%s>", a ? a : "NULL",
+            b ? b : "NULL");
+        return buf;
+    }
+    la = strlen(a);
+    lb = strlen(b);
+    /* Comparing the terminator too makes a proper prefix differ. */
+    d = _first_diff(a, b, (la < lb ? la : lb) + 1);
+    start = d > MTSUITE_DIFF_CHARS ? d - MTSUITE_DIFF_CHARS : 0;
+    for(i=0; i < 2; ++i){
+        const char *s = i ? b : a;
+        size_t l = i ? lb : la;
+        int shown = (int)(l - start < 2 * MTSUITE_DIFF_CHARS ?
+            l - start : 2 * MTSUITE_DIFF_CHARS);
+        _diff_printf(buf, size, &n, "%s<%s%.*s%s>", i ? " vs " : "",
+            start ? "..." : "", shown, s + start,
+            start + shown < l ? "..." : "");
+    }
+    if(d <= (la < lb ? la : lb)){
+        _diff_printf(buf, size, &n, " (first difference at offset %lu)",
+            (unsigned long)d);
+    }
+    return buf;
 }
 
 // ---
@@ -357,3 +6156,36 @@ char* mtsuite_format_hex(const void *val, unsigned long len){
     return result;
 }
 
+
+// ---
+void mtsuite_declare_begin(const char *prefix, const char *file, int line){
+    if(!strcmp(prefix, "FAIL")){ _name_failed_test(); }
+    _test_printf("\n  %s %s:%d: ", prefix, file, line);
+    msg_recording = !strcmp(prefix, "FAIL");
+    msg_file = file;
+    msg_line = line;
+}
+
+// ---
+void mtsuite_declare_printf(const char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    if(msg_recording){
+        char text[1024];
+        va_list ap2;
+        int n;
+        va_copy(ap2, ap);
+        n = vsnprintf(text, sizeof(text), fmt, ap2);
+        va_end(ap2);
+        if(n < 0){
+            n = 0;
+        }else if((size_t)n >= sizeof(text)){
+            n = sizeof(text) - 1;
+        }
+        text[n] = 0;
+        _messages_record(msg_file, msg_line, text);
+        msg_recording = 0;
+    }
+    _test_vprintf(fmt, ap);
+    va_end(ap);
+}
@@ -12,6 +12,9 @@
 #define MTSUITE_FIRST_USER_FLAG (1 << 4)
 
 typedef void (*TCallbackFn_t)(void*);
+typedef void (*TBenchFn_t)(void*, unsigned long iters);
+typedef void (*TAsyncFdFn_t)(void *arg, int fd, unsigned events);
+typedef void (*TAsyncTimerFn_t)(void *arg);
 struct Testcase_t;
 
 struct TestcaseSetup_t {
@@ -25,16 +28,70 @@ struct Testcase_t{
     unsigned long flags;
     const struct TestcaseSetup_t *config;
     void *info;
+    double timeout;     /* seconds; 0 = use --timeout, < 0 = never */
+    TBenchFn_t bench;   /* set instead of callback for a benchmark */
+    unsigned long bytes; /* bytes a benchmark processes per iteration */
+    /* Heap budgets, checked with --heap (in programs linked with
+     * mtsuite_heap) from setup through cleanup.  0 sets no limit;
+     * MTSUITE_NONE allows none at all. */
+    long max_allocs;    /* allocations */
+    long max_heap;      /* bytes asked for */
+    long max_leak;      /* bytes asked for and still held after cleanup */
+    /* Resources it needs when tests run side by side. */
+    unsigned cpus;      /* -j slots it occupies; 0 = 1 */
+    unsigned long max_memory;   /* address space cap in bytes; 0 = none;
+                                 * side by side, caps fit in --memory */
+    unsigned exclusive; /* nonzero: nothing else runs beside it */
+    /* Set instead of callback for an async test: starts it, and the test
+     * goes on in what it waits for with mtsuite_async_wait_fd() and
+     * mtsuite_async_after(). */
+    TCallbackFn_t async;
 };
 
-#define MTSUITE_END_OF_TESTCASES {NULL, NULL, 0, NULL, NULL}
+#define MTSUITE_NONE (-1L)   /* a heap budget that allows nothing */
+
+#define MTSUITE_END_OF_TESTCASES { NULL }
+
+struct Testgroup_t;
+
+/* Shared by every case of a group: built the first time a selected case of
+ * the group runs, torn down after the last one.  A case without a config
+ * of its own gets the fixture as its argument. */
+struct TestgroupSetup_t {
+    void* (*setup)(const struct Testgroup_t *);
+    int (*cleanup)(const struct Testgroup_t *, void *);
+};
 
 struct Testgroup_t {
     const char *prefix;
     struct Testcase_t *cases;
+    const struct TestgroupSetup_t *fixture;
+    unsigned long n_cases;  /* 0 = cases ends with MTSUITE_END_OF_TESTCASES */
 };
 
-#define MTSUITE_END_OF_GROUPS { NULL, NULL }
+#define MTSUITE_END_OF_GROUPS { NULL }
+
+/* Define a test and register it, without any array to keep: the
+ * descriptor goes in the mtsuite_tests linker section, where mtsuite_main
+ * finds every one of the program's registered tests as a single group.
+ * The full name is `prefix` (a string literal) followed by `id`; any
+ * further Testcase_t fields follow as designated initializers.  The body
+ * gets its setup's result as `data`:
+ *
+ *     MTSUITE_TEST("io/", short_read, .timeout=2){ ... end: ; }
+ *
+ * Registered tests must be linked in: from a static library, only objects
+ * something else refers to are. */
+#define MTSUITE_TEST(prefix, ...) MTSUITE_TEST_(prefix, __VA_ARGS__, )
+/* The empty last argument keeps `...` from ever being left out, which
+ * ISO C does not allow; it ends in a trailing comma instead. */
+#define MTSUITE_TEST_(prefix, id, ...) \
+    static void mtsuite_test_##id(void *data); \
+    static struct Testcase_t mtsuite_reg_##id \
+        __attribute__((used, section("mtsuite_tests"), \
+            aligned(__alignof__(struct Testcase_t)))) = { \
+        .name = prefix #id, .callback = mtsuite_test_##id, __VA_ARGS__ }; \
+    static void mtsuite_test_##id(void *data)
 
 struct TestlistAlias_t {
     const char *name;
@@ -51,16 +108,110 @@ int mtsuite_get_verbosity(void);
 int mtsuite_set_flag(
     struct Testgroup_t *, const char *, int set, unsigned long);
 char* mtsuite_format_hex(const void*, unsigned long);
+char* mtsuite_format_mem_diff(
+    char *buf, unsigned long size, const void*, const void*, unsigned long);
+char* mtsuite_format_str_diff(
+    char *buf, unsigned long size, const char*, const char*);
+void *mtsuite_group_fixture(void);
+/* Scratch memory for the running test, its setup and its cleanup, from
+ * the thread running it: aligned for any type, never freed one by one, and
+ * all taken back once the cleanup is done.  It is not zeroed: it may hold
+ * what an earlier test left there.  A group fixture's setup gets
+ * memory that lasts until its cleanup is done.  NULL if out of memory, or
+ * on a thread the test started itself. */
+void *mtsuite_arena_alloc(size_t size);
+char *mtsuite_arena_strdup(const char *s);
+/* With --trace, mark a span of the running test on the timeline; spans
+ * nest.  The name is copied, up to 127 bytes of it.  They do nothing
+ * otherwise. */
+void mtsuite_trace_begin(const char *name);
+void mtsuite_trace_end(void);
+/* For a running async test: call fn(arg, fd, revents) once `fd` is ready
+ * for `events` (POLLIN, POLLOUT...), or fn(arg) after `seconds`.  Each
+ * wait fires once; wait again to go on.  One wait per descriptor at a
+ * time.  The test is over once nothing is left to wait for, or as soon as
+ * it has failed.  0 on success, -1 with errno set otherwise. */
+int mtsuite_async_wait_fd(int fd, unsigned events, TAsyncFdFn_t fn,
+    void *arg);
+int mtsuite_async_after(double seconds, TAsyncTimerFn_t fn, void *arg);
+void mtsuite_declare_begin(const char *prefix, const char *file, int line);
+void mtsuite_declare_printf(const char *fmt, ...)
+#if defined(__GNUC__)
+    __attribute__((format(printf, 1, 2)))
+#endif
+    ;
 
 #define mtsuite_skip(groups, named) \
     mtsuite_set_flag(groups, names, 1, MTSUITE_SKIP) 
 
 int mtsuite_run_one(const struct Testgroup_t*, const struct Testcase_t *);
+/* The aliases runners made from now on start with. */
 void mtsuite_set_aliases(const struct TestlistAlias_t *aliases);
 int mtsuite_main(int argc, char **argv, struct Testgroup_t *groups);
 
+/* A runner runs a suite from inside a long-lived program, the way
+ * mtsuite_main does from the command line: make one for `groups` (NULL
+ * for only the registered tests), give it options ("--jobs=4", "--quiet")
+ * and tests ("net/..", ":net/slow", "@ALIAS") one at a time, run it, read
+ * its results and free it.  Each runner works on a copy of the tests and
+ * keeps all of its state to itself, so several can run at once, on
+ * different threads, over the same groups.  Failures on threads a test
+ * starts itself are only seen under mtsuite_main.
+ *
+ * Unlike mtsuite_main, a runner leaves the process's descriptors alone:
+ * what in-process tests print is not captured, and a report without
+ * --output goes to stdout next to the usual output.  It keeps no result
+ * cache unless given --cache=FILE (mtsuite_main finds one of its own for
+ * --failed-first and --rerun-failed), and cannot spawn tests (a spawned
+ * copy of the program has to reach mtsuite_main).
+ *
+ * The runner keeps its own copies of the file names and other strings
+ * its options give, and frees them with itself: an option string need not
+ * outlive the call.  It flushes only stdout, stderr and its own files
+ * before starting a child, and its forked children leave the program's
+ * other streams and atexit handlers alone; what it opens is close-on-exec.
+ *
+ * Options and tests that are not understood are reported and return -1.
+ * mtsuite_runner_run() returns 0 if everything passed, 1 if not, and -1 if
+ * it could not run or the runner itself failed part way (out of memory,
+ * say), which never ends the process; a runner runs once, and --help
+ * only prints. */
+struct Testrunner_t;
+
+#define MTSUITE_FAILED      0
+#define MTSUITE_OK          1
+#define MTSUITE_SKIPPED     2
+#define MTSUITE_TIMED_OUT   3
+
+struct TestrunResult_t {
+    const char *prefix;     /* of its group */
+    const char *name;
+    int outcome;            /* MTSUITE_OK, MTSUITE_FAILED... */
+    double seconds;         /* wall clock */
+    const char *messages;   /* "file:line: text\n" per failure, or NULL */
+};
+
+struct Testrunner_t *mtsuite_runner_new(struct Testgroup_t *groups);
+void mtsuite_runner_set_aliases(
+    struct Testrunner_t *, const struct TestlistAlias_t *aliases);
+int mtsuite_runner_option(struct Testrunner_t *, const char *option);
+int mtsuite_runner_select(struct Testrunner_t *, const char *test);
+int mtsuite_runner_run(struct Testrunner_t *);
+/* One result per test run or skipped, in the order they finished; valid
+ * until the runner is freed. */
+const struct TestrunResult_t *mtsuite_runner_results(
+    const struct Testrunner_t *, int *n_results);
+void mtsuite_runner_free(struct Testrunner_t *);
+
 // ------- OTHER MACROS -------
 
+/* Keep the compiler from optimizing away a benchmark's work on `p`. */
+#if defined(__GNUC__)
+#define MTSUITE_CLOBBER(p) __asm__ volatile("" : : "g"(p) : "memory")
+#else
+#define MTSUITE_CLOBBER(p) ((void)(*(volatile char *)(p)))
+#endif
+
 #define MTSUITE_BEGIN_STMT do {
 #define MTSUITE_END_STMT } while(0)
 
@@ -72,8 +223,8 @@ int mtsuite_main(int argc, char **argv, struct Testgroup_t *groups);
 #ifndef MTSUITE_DECLARE
 #define MTSUITE_DECLARE(prefix, args)                       \
     MTSUITE_BEGIN_STMT                                      \
-    printf("\n  %s %s:%d: ", prefix, __FILE__, __LINE__);   \
-    printf args;                                            \
+    mtsuite_declare_begin(prefix, __FILE__, __LINE__);      \
+    mtsuite_declare_printf args;                            \
     MTSUITE_END_STMT
 #endif
 
@@ -187,20 +338,56 @@ int mtsuite_main(int argc, char **argv, struct Testgroup_t *groups);
     mttsuite_assert_test_type(a,b,#a" "#op" "#b, void*, (val1_ op val2_),    \
         "%p", MTSUITE_EXIT_TEST_FUNCTION)
 
+/* Room for a failed string or buffer comparison: the first difference and
+ * a few rows of hexdump around it.  Formatted on the stack, so neither
+ * passing nor failing allocates. */
+#define MTSUITE_DIFF_BUFLEN 768
+
+#define _mttsuite_str_test(a,op,b,dieOnFail)                             \
+    MTSUITE_BEGIN_STMT                                                  \
+    const char *val1_ = (a);                                            \
+    const char *val2_ = (b);                                            \
+    int _mtsuite_status = (val1_ && val2_ && strcmp(val1_, val2_) op 0); \
+    if(!_mtsuite_status || mtsuite_get_verbosity() > 1){                \
+        char diff_[MTSUITE_DIFF_BUFLEN];                                \
+        MTSUITE_DECLARE(_mtsuite_status?"  OK":"FAIL",                  \
+            ("assert(%s): %s", #a" "#op" "#b,                           \
+            mtsuite_format_str_diff(diff_, sizeof(diff_), val1_, val2_))); \
+        if(!_mtsuite_status){                                           \
+            mtsuite_set_test_failed();                                  \
+            dieOnFail;                                                  \
+        }                                                               \
+    }                                                                   \
+    MTSUITE_END_STMT
+
+#define _mttsuite_mem_test(expr1,op,expr2,len,dieOnFail)                 \
+    MTSUITE_BEGIN_STMT                                                  \
+    const void *val1_ = (expr1);                                        \
+    const void *val2_ = (expr2);                                        \
+    unsigned long len_ = (len);                                         \
+    int _mtsuite_status =                                               \
+        (val1_ && val2_ && memcmp(val1_, val2_, len_) op 0);            \
+    if(!_mtsuite_status || mtsuite_get_verbosity() > 1){                \
+        char diff_[MTSUITE_DIFF_BUFLEN];                                \
+        MTSUITE_DECLARE(_mtsuite_status?"  OK":"FAIL",                  \
+            ("assert(%s): %s", #expr1" "#op" "#expr2,                   \
+            mtsuite_format_mem_diff(diff_, sizeof(diff_),               \
+                val1_, val2_, len_)));                                  \
+        if(!_mtsuite_status){                                           \
+            mtsuite_set_test_failed();                                  \
+            dieOnFail;                                                  \
+        }                                                               \
+    }                                                                   \
+    MTSUITE_END_STMT
+
 #define mttsuite_str_op(a,op,b)                                          \
-    mttsuite_assert_test_type(a,b,#a" "#op" "#b, const char*,            \
-        (val1_ && val2_ && strcmp(val1_, val2_) op 0),                  \
-        "<%s>", MTSUITE_EXIT_TEST_FUNCTION)
+    _mttsuite_str_test(a,op,b,MTSUITE_EXIT_TEST_FUNCTION)
 
 #define mttsuite_mem_op(expr1,op,expr2, len)                             \
-    mttsuite_assert_test_fmt_type(expr1,expr2,#expr1" "#op" "#expr2,     \
-         const void*,                                                   \
-         (val1_ && val2_ && memcmp(val1_, val2_, len) op 0),            \
-         char *, "%s",                                                  \
-         {print_ = mtsuite_format_hex(value_, (len)); },                \
-         { if(print_) free(print_); },                                  \
-         MTSUITE_EXIT_TEST_FUNCTION \
-        );
+    _mttsuite_mem_test(expr1,op,expr2,len,MTSUITE_EXIT_TEST_FUNCTION)
+
+#define mttsuite_want_mem_op(expr1,op,expr2, len)                        \
+    _mttsuite_mem_test(expr1,op,expr2,len,(void)0)
 
 #define mttsuite_want_int_op(a,op,b)                                     \
     mttsuite_assert_test_type(a,b,#a" "#op" "#b, long, (val1_ op val2_), \
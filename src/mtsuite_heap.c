@@ -0,0 +1,75 @@
+/* The allocator hooks behind --heap.  Linking this in (the mtsuite_heap
+ * library) interposes malloc and friends on the whole program: each one
+ * hands the call to glibc's allocator and, while a runner counts, tells
+ * mtsuite_heap_note about it.  Programs that do not link it keep their
+ * allocator, be it glibc's, jemalloc or a sanitizer's. */
+#include<errno.h>
+#include<stdatomic.h>
+#include<stddef.h>
+#include<stdlib.h>
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#include<malloc.h>
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+extern void __libc_free(void *);
+
+/* In mtsuite.c. */
+extern _Atomic int mtsuite_heap_runners;
+void mtsuite_heap_note(const void *got, size_t asked, const void *gone);
+
+/* Tells mtsuite.c that the hooks are in. */
+const int mtsuite_heap_hooks = 1;
+
+void *malloc(size_t size){
+    void *p = __libc_malloc(size);
+    if(mtsuite_heap_runners && p){ mtsuite_heap_note(p, size, NULL); }
+    return p;
+}
+
+void *calloc(size_t n, size_t size){
+    void *p = __libc_calloc(n, size);
+    if(mtsuite_heap_runners && p){ mtsuite_heap_note(p, n * size, NULL); }
+    return p;
+}
+
+void *realloc(void *ptr, size_t size){
+    void *p;
+    if(!mtsuite_heap_runners){ return __libc_realloc(ptr, size); }
+    p = __libc_realloc(ptr, size);
+    if(p){
+        mtsuite_heap_note(p, size, ptr);
+    }else if(!size){
+        mtsuite_heap_note(NULL, 0, ptr);
+    }
+    return p;
+}
+
+void free(void *ptr){
+    if(mtsuite_heap_runners && ptr){ mtsuite_heap_note(NULL, 0, ptr); }
+    __libc_free(ptr);
+}
+
+void *memalign(size_t align, size_t size){
+    void *p = __libc_memalign(align, size);
+    if(mtsuite_heap_runners && p){ mtsuite_heap_note(p, size, NULL); }
+    return p;
+}
+
+void *aligned_alloc(size_t align, size_t size){
+    return memalign(align, size);
+}
+
+int posix_memalign(void **out, size_t align, size_t size){
+    void *p;
+    if(!align || (align & (align - 1)) || align % sizeof(void*)){
+        return EINVAL;
+    }
+    if(!(p = memalign(align, size))){ return ENOMEM; }
+    *out = p;
+    return 0;
+}
+#endif
@@ -34,18 +34,16 @@ typedef struct DataBuffer{
     char buf2[512];
 } DataBuffer;
 
+/* The arena takes the buffer back after cleanup; nothing to free.  It
+ * hands out memory as an earlier test left it, so clear it first. */
 void* new_db(const struct Testcase_t *tcase){
-    DataBuffer *db = malloc(sizeof(DataBuffer));
+    DataBuffer *db = mtsuite_arena_alloc(sizeof(DataBuffer));
+    if(db){ memset(db, 0, sizeof(*db)); }
     return db;
 }
 
 int delete_db(const struct Testcase_t *tcase, void *ptr){
-    DataBuffer *db = ptr;
-    if(db){
-        free(db);
-        return 1;
-    }
-    return 0;
+    return ptr != NULL;
 }
 
 struct TestcaseSetup_t dbsetup = {
@@ -56,50 +54,134 @@ struct TestcaseSetup_t dbsetup = {
 void test_memcpy(void *ptr){
     DataBuffer *db = ptr;
     char *mem = NULL;
+    mtsuite_trace_begin("copy");
     strcpy(db->buf1, "String 0");
     memcpy(db->buf2, db->buf1, sizeof(db->buf1));
+    mtsuite_trace_end();
     mttsuite_str_op(db->buf1, OP_EQ, db->buf2);
     db->buf2[100] = 3;
     mttsuite_mem_op(db->buf1, OP_LT, db->buf2, sizeof(db->buf1));
-    mem = strdup("Hello world.");
+    mem = mtsuite_arena_strdup("Hello world.");
     mttsuite_assert(mem);
     mttsuite_str_op(db->buf1, OP_NE, mem);
 
 end:
-    if(mem){free(mem); }
+    ;
+}
+
+/* Async: the runner's loop calls timeout_done back; nothing sleeps. */
+static time_t timeout_started;
+
+void timeout_done(void *arg){
+    time_t t2 = time(NULL);
+    (void)arg;
+    mttsuite_int_op(t2-timeout_started, OP_GE, 4);
+    mttsuite_int_op(t2-timeout_started, OP_LE, 6);
+
+end:
+    ;
 }
 
 void test_timeout(void *ptr){
-    time_t t1, t2;
     (void)ptr;
-    t1 = time(NULL);
-    sleep(5);
-    t2 = time(NULL);
-    mttsuite_int_op(t2-t1, OP_GE, 4);
-    mttsuite_int_op(t2-t1, OP_LE, 6);
+    timeout_started = time(NULL);
+    mttsuite_int_op(mtsuite_async_after(5, timeout_done, NULL), OP_EQ, 0);
+
+end:
+    ;
+}
+
+void bench_memcpy(void *ptr, unsigned long iters){
+    DataBuffer *db = ptr;
+    unsigned long i;
+    memset(db->buf1, 'x', sizeof(db->buf1));
+    for(i=0; i < iters; ++i){
+        memcpy(db->buf2, db->buf1, sizeof(db->buf1));
+        MTSUITE_CLOBBER(db->buf2);
+    }
+    mttsuite_int_op(db->buf2[100], OP_EQ, 'x');
+
+end:
+    ;
+}
+
+/* A table every fixture/ case shares: built once, not once per case. */
+void* new_squares(const struct Testgroup_t *group){
+    unsigned long *squares = malloc(1024 * sizeof(*squares));
+    unsigned long i;
+    (void)group;
+    if(squares){
+        for(i=0; i < 1024; ++i){ squares[i] = i * i; }
+    }
+    return squares;
+}
+
+int delete_squares(const struct Testgroup_t *group, void *ptr){
+    (void)group;
+    free(ptr);
+    return 1;
+}
+
+struct TestgroupSetup_t squaresetup = {
+    .setup=new_squares,
+    .cleanup=delete_squares
+};
+
+void test_squares(void *ptr){
+    unsigned long *squares = ptr;
+    mttsuite_uint_op(squares[12], OP_EQ, 144);
+    mttsuite_uint_op(squares[1023], OP_EQ, 1023 * 1023);
 
 end:
     ;
 }
 
+void test_squares_shared(void *ptr){
+    mttsuite_ptr_op(ptr, OP_EQ, mtsuite_group_fixture());
+
+end:
+    ;
+}
+
+/* Registered where it is defined: no array entry needed. */
+MTSUITE_TEST("registered/", arena_strdup){
+    char *copy = mtsuite_arena_strdup("registered");
+    (void)data;
+    mttsuite_str_op(copy, OP_EQ, "registered");
+
+end:
+    ;
+}
+
+struct Testcase_t fixtureTests[] = {
+    {.name="squares", .callback=test_squares, },
+    {.name="shared", .callback=test_squares_shared, },
+    MTSUITE_END_OF_TESTCASES
+};
+
 struct Testcase_t demoTests[] = {
     {.name="strcmp", .callback=test_strcmp, },
     {.name="memcpy", .callback=test_memcpy, .config=&dbsetup, },
-    {.name="timeout", .callback=test_timeout, },
+    {.name="timeout", .async=test_timeout, .timeout=10, },
+    {.name="memcpy_bench", .bench=bench_memcpy, .config=&dbsetup,
+        .bytes=sizeof(((DataBuffer*)0)->buf1), },
     MTSUITE_END_OF_TESTCASES
 };
 
 struct Testgroup_t groups[] = {
     {.prefix="demo/", .cases=demoTests},
+    {.prefix="fixture/", .cases=fixtureTests, .fixture=&squaresetup},
     MTSUITE_END_OF_GROUPS
 };
 
 
 const char *alltests[] = {"+..", NULL};
 const char *slowtests[] = {"+demo/timeout", NULL};
+const char *benchmarks[] = {"demo/memcpy_bench", NULL};
 struct TestlistAlias_t aliases[] = {
     {"ALL", alltests},
     {"SLOW", slowtests},
+    {"BENCH", benchmarks},
     MTSUITE_END_OF_ALIASES
 };
 
@@ -0,0 +1,413 @@
+#include "mtsuite.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<signal.h>
+#include<unistd.h>
+#include<sys/wait.h>
+
+#define OP_LT <
+#define OP_EQ ==
+#define OP_NE !=
+
+/* The suite's own checks: each runs a small suite on a runner of its own
+ * and looks at what that run reported. */
+
+/* Run `groups` with `options` (NULL-terminated) on a fresh runner and
+ * store what mtsuite_runner_run() returned in *result.  The results stay
+ * valid until the runner is freed. */
+static struct Testrunner_t *run_inner(
+    struct Testgroup_t *groups, const char *const *options, int *result
+){
+    struct Testrunner_t *run = mtsuite_runner_new(groups);
+    *result = -2;
+    if(!run){ return NULL; }
+    for(; *options; ++options){
+        if(mtsuite_runner_option(run, *options)){
+            mtsuite_runner_free(run);
+            return NULL;
+        }
+    }
+    *result = mtsuite_runner_run(run);
+    return run;
+}
+
+/* The outcome `run` reported for prefix+name, or -1 if it ran no such
+ * test. */
+static int outcome_of(const struct Testrunner_t *run, const char *fullname){
+    const struct TestrunResult_t *res;
+    int n, i;
+    res = mtsuite_runner_results(run, &n);
+    for(i=0; i < n; ++i){
+        size_t len = strlen(res[i].prefix);
+        if(!strncmp(fullname, res[i].prefix, len) &&
+                !strcmp(fullname + len, res[i].name)){
+            return res[i].outcome;
+        }
+    }
+    return -1;
+}
+
+// ------- HEAP BUDGETS -------
+/* Kept here so the compiler cannot drop an allocation it sees freed. */
+static void *volatile heap_sink;
+
+static void heap_alloc(size_t n, int times){
+    int i;
+    for(i=0; i < times; ++i){
+        heap_sink = malloc(n);
+        free(heap_sink);
+    }
+}
+
+static void heap_clean(void *data){ (void)data; heap_alloc(64, 3); }
+static void heap_leak(void *data){ (void)data; heap_sink = malloc(64); }
+
+struct Testcase_t heapCases[] = {
+    {.name="unlimited", .callback=heap_clean, },
+    {.name="within", .callback=heap_clean, .max_allocs=3, .max_heap=192, },
+    {.name="over_allocs", .callback=heap_clean, .max_allocs=2, },
+    {.name="over_heap", .callback=heap_clean, .max_heap=100, },
+    {.name="none", .callback=heap_clean, .max_allocs=MTSUITE_NONE, },
+    {.name="leak", .callback=heap_leak, .max_leak=MTSUITE_NONE, },
+    {.name="leak_allowed", .callback=heap_leak, .max_leak=100, },
+    {.name="leak_over", .callback=heap_leak, .max_leak=16, },
+    MTSUITE_END_OF_TESTCASES
+};
+
+struct Testgroup_t heapGroups[] = {
+    {.prefix="heap/", .cases=heapCases},
+    MTSUITE_END_OF_GROUPS
+};
+
+void test_heap_budgets(void *data){
+    static const char *const options[] = {"--quiet", "--heap", NULL};
+    struct Testrunner_t *run;
+    int result;
+    (void)data;
+    run = run_inner(heapGroups, options, &result);
+    mttsuite_assert(run);
+    mttsuite_int_op(result, OP_EQ, 1);
+    mttsuite_int_op(outcome_of(run, "heap/unlimited"), OP_EQ, MTSUITE_OK);
+    mttsuite_int_op(outcome_of(run, "heap/within"), OP_EQ, MTSUITE_OK);
+    mttsuite_int_op(outcome_of(run, "heap/over_allocs"), OP_EQ,
+        MTSUITE_FAILED);
+    mttsuite_int_op(outcome_of(run, "heap/over_heap"), OP_EQ,
+        MTSUITE_FAILED);
+    mttsuite_int_op(outcome_of(run, "heap/none"), OP_EQ, MTSUITE_FAILED);
+
+end:
+    mtsuite_runner_free(run);
+}
+
+void test_heap_leaks(void *data){
+    static const char *const options[] = {"--quiet", "--heap", NULL};
+    struct Testrunner_t *run;
+    int result;
+    (void)data;
+    run = run_inner(heapGroups, options, &result);
+    mttsuite_assert(run);
+    mttsuite_int_op(outcome_of(run, "heap/leak"), OP_EQ, MTSUITE_FAILED);
+    mttsuite_int_op(outcome_of(run, "heap/leak_allowed"), OP_EQ, MTSUITE_OK);
+    mttsuite_int_op(outcome_of(run, "heap/leak_over"), OP_EQ,
+        MTSUITE_FAILED);
+
+end:
+    mtsuite_runner_free(run);
+}
+
+// ------- SHARDS -------
+static void shard_nothing(void *data){ (void)data; }
+
+struct Testcase_t shardCases[] = {
+    {.name="t0", .callback=shard_nothing, },
+    {.name="t1", .callback=shard_nothing, },
+    {.name="t2", .callback=shard_nothing, },
+    {.name="t3", .callback=shard_nothing, },
+    {.name="t4", .callback=shard_nothing, },
+    {.name="t5", .callback=shard_nothing, },
+    {.name="t6", .callback=shard_nothing, },
+    MTSUITE_END_OF_TESTCASES
+};
+
+struct Testgroup_t shardGroups[] = {
+    {.prefix="shard/", .cases=shardCases},
+    MTSUITE_END_OF_GROUPS
+};
+
+/* For 1 to 4 shards: every test runs in exactly one of them. */
+void test_shards_partition(void *data){
+    struct Testrunner_t *run = NULL;
+    int n_shards, shard, i;
+    (void)data;
+    for(n_shards=1; n_shards <= 4; ++n_shards){
+        int seen[7] = {0};
+        for(shard=1; shard <= n_shards; ++shard){
+            char opt[32];
+            const char *options[] = {"--quiet", opt, NULL};
+            const struct TestrunResult_t *res;
+            int result, n;
+            snprintf(opt, sizeof(opt), "--shard=%d/%d", shard, n_shards);
+            run = run_inner(shardGroups, options, &result);
+            mttsuite_assert(run);
+            mttsuite_int_op(result, OP_EQ, 0);
+            res = mtsuite_runner_results(run, &n);
+            for(i=0; i < n; ++i){
+                mttsuite_int_op(res[i].name[0], OP_EQ, 't');
+                ++seen[res[i].name[1] - '0'];
+            }
+            mtsuite_runner_free(run);
+            run = NULL;
+        }
+        for(i=0; i < 7; ++i){
+            mttsuite_int_op(seen[i], OP_EQ, 1);
+        }
+    }
+
+end:
+    mtsuite_runner_free(run);
+}
+
+// ------- RESULT CACHE -------
+static int cache_should_fail;
+
+static void cache_pass(void *data){ (void)data; }
+static void cache_flaky(void *data){
+    (void)data;
+    mttsuite_int_op(cache_should_fail, OP_EQ, 0);
+
+end:
+    ;
+}
+
+struct Testcase_t cacheCases[] = {
+    {.name="first", .callback=cache_pass, },
+    {.name="flaky", .callback=cache_flaky, },
+    {.name="last", .callback=cache_pass, },
+    MTSUITE_END_OF_TESTCASES
+};
+
+struct Testgroup_t cacheGroups[] = {
+    {.prefix="cache/", .cases=cacheCases},
+    MTSUITE_END_OF_GROUPS
+};
+
+void test_cache_reorder(void *data){
+    char fname[] = "/tmp/mtsuitetests-cache-XXXXXX";
+    char cache_opt[sizeof(fname) + 8];
+    const char *options[] = {"--quiet", cache_opt, NULL, NULL};
+    struct Testrunner_t *run = NULL;
+    const struct TestrunResult_t *res;
+    int fd, result, n;
+    (void)data;
+    fd = mkstemp(fname);
+    mttsuite_assert(fd != -1);
+    close(fd);
+    snprintf(cache_opt, sizeof(cache_opt), "--cache=%s", fname);
+
+    /* Plain order; cache/flaky fails and is remembered. */
+    cache_should_fail = 1;
+    run = run_inner(cacheGroups, options, &result);
+    mttsuite_assert(run);
+    mttsuite_int_op(result, OP_EQ, 1);
+    res = mtsuite_runner_results(run, &n);
+    mttsuite_int_op(n, OP_EQ, 3);
+    mttsuite_str_op(res[0].name, OP_EQ, "first");
+    mtsuite_runner_free(run);
+
+    /* It goes first now, and passes. */
+    cache_should_fail = 0;
+    options[2] = "--failed-first";
+    run = run_inner(cacheGroups, options, &result);
+    mttsuite_assert(run);
+    mttsuite_int_op(result, OP_EQ, 0);
+    res = mtsuite_runner_results(run, &n);
+    mttsuite_int_op(n, OP_EQ, 3);
+    mttsuite_str_op(res[0].name, OP_EQ, "flaky");
+    mtsuite_runner_free(run);
+
+    /* With nothing failed last time, there is nothing to rerun. */
+    options[2] = "--rerun-failed";
+    run = run_inner(cacheGroups, options, &result);
+    mttsuite_assert(run);
+    mtsuite_runner_results(run, &n);
+    mttsuite_int_op(n, OP_EQ, 0);
+    mtsuite_runner_free(run);
+
+    /* Fail it again: only it is rerun. */
+    cache_should_fail = 1;
+    options[2] = NULL;
+    run = run_inner(cacheGroups, options, &result);
+    mttsuite_assert(run);
+    mtsuite_runner_free(run);
+    options[2] = "--rerun-failed";
+    run = run_inner(cacheGroups, options, &result);
+    mttsuite_assert(run);
+    res = mtsuite_runner_results(run, &n);
+    mttsuite_int_op(n, OP_EQ, 1);
+    mttsuite_str_op(res[0].name, OP_EQ, "flaky");
+
+end:
+    mtsuite_runner_free(run);
+    unlink(fname);
+}
+
+// ------- DEADLINES -------
+static void deadline_hang(void *data){ (void)data; sleep(30); }
+static void deadline_quick(void *data){ (void)data; }
+
+struct Testcase_t deadlineCases[] = {
+    {.name="hang", .callback=deadline_hang, .timeout=0.2, },
+    {.name="quick", .callback=deadline_quick, .timeout=5, },
+    MTSUITE_END_OF_TESTCASES
+};
+
+struct Testgroup_t deadlineGroups[] = {
+    {.prefix="deadline/", .cases=deadlineCases},
+    MTSUITE_END_OF_GROUPS
+};
+
+static void check_deadlines(const char *const *options){
+    struct Testrunner_t *run;
+    const struct TestrunResult_t *res;
+    int result, n, i;
+    run = run_inner(deadlineGroups, options, &result);
+    mttsuite_assert(run);
+    mttsuite_int_op(result, OP_EQ, 1);
+    mttsuite_int_op(outcome_of(run, "deadline/hang"), OP_EQ,
+        MTSUITE_TIMED_OUT);
+    mttsuite_int_op(outcome_of(run, "deadline/quick"), OP_EQ, MTSUITE_OK);
+    res = mtsuite_runner_results(run, &n);
+    for(i=0; i < n; ++i){
+        /* Stopped at its deadline plus the grace period, not at 30 s. */
+        mttsuite_want(res[i].seconds < 10);
+    }
+
+end:
+    mtsuite_runner_free(run);
+}
+
+void test_deadline(void *data){
+    static const char *const serial[] = {"--quiet", NULL};
+    static const char *const jobs[] = {"--quiet", "--jobs=2", NULL};
+    static const char *const pool[] =
+        {"--quiet", "--jobs=2", "--isolation=pool", NULL};
+    (void)data;
+    check_deadlines(serial);
+    check_deadlines(jobs);
+    check_deadlines(pool);
+}
+
+// ------- POOL WORKERS -------
+static void worker_abort(void *data){ (void)data; abort(); }
+static void worker_exit(void *data){ (void)data; _exit(3); }
+static void worker_fine(void *data){ (void)data; }
+
+struct Testcase_t workerCases[] = {
+    {.name="abort", .callback=worker_abort, },
+    {.name="after_abort", .callback=worker_fine, },
+    {.name="exit", .callback=worker_exit, },
+    {.name="after_exit", .callback=worker_fine, },
+    MTSUITE_END_OF_TESTCASES
+};
+
+struct Testgroup_t workerGroups[] = {
+    {.prefix="worker/", .cases=workerCases},
+    MTSUITE_END_OF_GROUPS
+};
+
+/* A worker that dies fails only its test; a fresh one runs the rest. */
+void test_pool_worker_death(void *data){
+    static const char *const options[] =
+        {"--quiet", "--jobs=1", "--isolation=pool", NULL};
+    struct Testrunner_t *run;
+    int result, n;
+    (void)data;
+    run = run_inner(workerGroups, options, &result);
+    mttsuite_assert(run);
+    mttsuite_int_op(result, OP_EQ, 1);
+    mtsuite_runner_results(run, &n);
+    mttsuite_int_op(n, OP_EQ, 4);
+    mttsuite_int_op(outcome_of(run, "worker/abort"), OP_EQ, MTSUITE_FAILED);
+    mttsuite_int_op(outcome_of(run, "worker/after_abort"), OP_EQ,
+        MTSUITE_OK);
+    mttsuite_int_op(outcome_of(run, "worker/exit"), OP_EQ, MTSUITE_FAILED);
+    mttsuite_int_op(outcome_of(run, "worker/after_exit"), OP_EQ, MTSUITE_OK);
+
+end:
+    mtsuite_runner_free(run);
+}
+
+// ------- EXIT CODES -------
+/* Run this program with `args` (NULL-terminated, after argv[0]) and
+ * return its exit status, or -1 if it did not exit. */
+static int exit_status_of(const char *const *args){
+    const char *argv[8];
+    int n = 0, status;
+    pid_t pid;
+    argv[n++] = "mtsuitetests";
+    while(*args && n < 7){ argv[n++] = *args++; }
+    argv[n] = NULL;
+    fflush(NULL);
+    if((pid = fork()) == -1){ return -1; }
+    if(!pid){
+        execv("/proc/self/exe", (char *const *)argv);
+        _exit(127);
+    }
+    while(waitpid(pid, &status, 0) == -1){}
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void test_exit_codes(void *data){
+    static const char *const pass[] = {"--quiet", "exit/pass", NULL};
+    static const char *const fail[] = {"--quiet", "+exit/fail", NULL};
+    static const char *const bad_option[] = {"--no-such-option", NULL};
+    static const char *const bad_test[] = {"exit/no_such_test", NULL};
+    (void)data;
+    mttsuite_int_op(exit_status_of(pass), OP_EQ, 0);
+    mttsuite_int_op(exit_status_of(fail), OP_EQ, 1);
+    mttsuite_int_op(exit_status_of(bad_option), OP_EQ, 255);
+    mttsuite_int_op(exit_status_of(bad_test), OP_EQ, 255);
+
+end:
+    ;
+}
+
+static void exit_pass(void *data){ (void)data; }
+static void exit_fail(void *data){
+    (void)data;
+    mttsuite_fail();
+
+end:
+    ;
+}
+
+
+struct Testcase_t checkTests[] = {
+    {.name="heap_budgets", .callback=test_heap_budgets, },
+    {.name="heap_leaks", .callback=test_heap_leaks, },
+    {.name="shards_partition", .callback=test_shards_partition, },
+    {.name="cache_reorder", .callback=test_cache_reorder, },
+    {.name="deadline", .callback=test_deadline, },
+    {.name="pool_worker_death", .callback=test_pool_worker_death, },
+    {.name="exit_codes", .callback=test_exit_codes, },
+    MTSUITE_END_OF_TESTCASES
+};
+
+/* What test_exit_codes runs this program on. */
+struct Testcase_t exitTests[] = {
+    {.name="pass", .callback=exit_pass, },
+    {.name="fail", .callback=exit_fail, .flags=MTSUITE_OFF_BY_DEFAULT, },
+    MTSUITE_END_OF_TESTCASES
+};
+
+struct Testgroup_t groups[] = {
+    {.prefix="check/", .cases=checkTests},
+    {.prefix="exit/", .cases=exitTests},
+    MTSUITE_END_OF_GROUPS
+};
+
+
+int main(int argc, char **argv){
+    return mtsuite_main(argc, argv, groups);
+}